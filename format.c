@@ -0,0 +1,101 @@
+/*
+    Number to text conversion for the csv rows, without stdio and locale.
+    Values are written with a fixed number of decimals like printf("%.*f").
+
+    Copyright (C) 2015  Steffen Kühn / steffen.kuehn@em-sys-dev.de
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include <stdio.h>
+#include <string.h>
+#include <math.h>
+#include "format.h"
+
+// The value is scaled by 10^decimals and rounded to an integer, which is
+// then written with two digits per division.
+
+static const char digit_pairs[] =
+	"00010203040506070809101112131415161718192021222324252627282930313233343536373839"
+	"40414243444546474849505152535455565758596061626364656667686970717273747576777879"
+	"8081828384858687888990919293949596979899";
+
+static const double pow10_scale[FORMAT_MAX_DECIMALS + 1] = {
+	1e0, 1e1, 1e2, 1e3, 1e4, 1e5, 1e6, 1e7, 1e8, 1e9
+};
+
+static const uint64_t pow10_int[FORMAT_MAX_DECIMALS + 1] = {
+	1ULL, 10ULL, 100ULL, 1000ULL, 10000ULL, 100000ULL, 1000000ULL, 10000000ULL,
+	100000000ULL, 1000000000ULL
+};
+
+// writes the n lowest digits of v, with leading zeros, to dst[0..n-1]
+static void write_digits(char* dst, uint64_t v, int n)
+{
+	char* p = dst + n;
+
+	while (n >= 2)
+	{
+		p -= 2;
+		memcpy(p, digit_pairs + 2 * (v % 100), 2);
+		v /= 100;
+		n -= 2;
+	}
+	if (n) *--p = '0' + v % 10;
+}
+
+int format_uint(char* dst, uint64_t v)
+{
+	int n = 1;
+	for (uint64_t p = 10;(n < 20) && (v >= p);p *= 10) n++;
+
+	write_digits(dst, v, n);
+	return n;
+}
+
+int format_fixed(char* dst, double v, int decimals)
+{
+	if (decimals < 0) decimals = 0;
+	if (decimals > FORMAT_MAX_DECIMALS) decimals = FORMAT_MAX_DECIMALS;
+
+	double scaled = fabs(v) * pow10_scale[decimals];
+	if (!(scaled < 4503599627370496.0))
+	{
+		// 2^52 and more have no fraction bits left to round by, nan and inf
+		int n = snprintf(dst, FORMAT_FIXED_MAX, "%.*e", decimals, v);
+		return (n < FORMAT_FIXED_MAX) ? n : FORMAT_FIXED_MAX - 1;
+	}
+
+	// rint() rounds half to even like printf does for exact ties. The product
+	// may have been rounded onto a tie, its exact error (by fma) decides then.
+	uint64_t q = (uint64_t)rint(scaled);
+	if (scaled - floor(scaled) == 0.5)
+	{
+		double err = fma(fabs(v), pow10_scale[decimals], -scaled);
+		if (err > 0) q = (uint64_t)ceil(scaled);
+		else if (err < 0) q = (uint64_t)floor(scaled);
+	}
+	char* p = dst;
+
+	if (signbit(v)) *p++ = '-';
+	p += format_uint(p, q / pow10_int[decimals]);
+	if (decimals)
+	{
+		*p++ = '.';
+		write_digits(p, q % pow10_int[decimals], decimals);
+		p += decimals;
+	}
+
+	return p - dst;
+}
@@ -0,0 +1,39 @@
+/*
+    Number to text conversion for the csv rows, without stdio and locale.
+    Values are written with a fixed number of decimals like printf("%.*f").
+
+    Copyright (C) 2015  Steffen Kühn / steffen.kuehn@em-sys-dev.de
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef FORMAT_H
+#define FORMAT_H
+
+#include <stdint.h>
+
+#define FORMAT_MAX_DECIMALS 9
+#define FORMAT_FIXED_MAX 32 // chars format_fixed() and format_uint() write at most
+
+// Writes v with decimals (0..FORMAT_MAX_DECIMALS) digits after the point
+// to dst, without a terminating 0, and returns the number of chars. The
+// result is the one of printf("%.*f"). Values of 2^52 / 10^decimals and more,
+// nan and inf are written like printf("%.*e").
+int format_fixed(char* dst, double v, int decimals);
+
+// writes v in decimal to dst, without a terminating 0, returns the number
+// of chars
+int format_uint(char* dst, uint64_t v);
+
+#endif
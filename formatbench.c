@@ -0,0 +1,120 @@
+/*
+    Benchmark of the csv row formatting: printf("%f") against format_fixed().
+    Usage: formatbench [bins] [rows] [decimals], "make bench" builds and runs it.
+
+    Copyright (C) 2015  Steffen Kühn / steffen.kuehn@em-sys-dev.de
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <time.h>
+#include "format.h"
+
+static double now(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+// a row the way it was written before: one printf per value
+static int row_printf(char* dst, const double* v, int nbins, int decimals)
+{
+	char* p = dst;
+	for (int k = 0;k < nbins;k++)
+	{
+		p += sprintf(p, ",%.*f", decimals, v[k]);
+	}
+	*p++ = '\n';
+	return p - dst;
+}
+
+static int row_fixed(char* dst, const double* v, int nbins, int decimals)
+{
+	char* p = dst;
+	for (int k = 0;k < nbins;k++)
+	{
+		*p++ = ',';
+		p += format_fixed(p, v[k], decimals);
+	}
+	*p++ = '\n';
+	return p - dst;
+}
+
+// rows per second of fmt, the text of the last row stays in buf
+static double measure(int (*fmt)(char*, const double*, int, int), char* buf,
+	const double* values, int nbins, int nrows, int decimals)
+{
+	double t0 = now();
+	for (int r = 0;r < nrows;r++)
+	{
+		buf[fmt(buf, values + (r % 16) * nbins, nbins, decimals)] = 0;
+	}
+	return nrows / (now() - t0);
+}
+
+int main(int argc, char** argv)
+{
+	int nbins = (argc > 1) ? atoi(argv[1]) : 501;
+	int nrows = (argc > 2) ? atoi(argv[2]) : 20000;
+	int decimals = (argc > 3) ? atoi(argv[3]) : 6;
+
+	if ((nbins < 1) || (nrows < 1) || (decimals < 0) || (decimals > FORMAT_MAX_DECIMALS))
+	{
+		printf("usage: formatbench [bins] [rows] [decimals 0..%i]\n", FORMAT_MAX_DECIMALS);
+		return 1;
+	}
+
+	// 16 rows of spectrum like values from 1e-4 to 1e4 mg
+	double* values = malloc(sizeof(double) * 16 * nbins);
+	srand(1);
+	for (int i = 0;i < 16 * nbins;i++)
+	{
+		values[i] = exp((rand() / (double)RAND_MAX - 0.5) * 18.4);
+	}
+
+	char* a = malloc((size_t)nbins * (FORMAT_FIXED_MAX + 1) + 2);
+	char* b = malloc((size_t)nbins * (FORMAT_FIXED_MAX + 1) + 2);
+
+	// how often the two differ, all 16 rows
+	int diff = 0;
+	for (int r = 0;r < 16;r++)
+	{
+		char sa[FORMAT_FIXED_MAX + 1], sb[FORMAT_FIXED_MAX + 1];
+		for (int k = 0;k < nbins;k++)
+		{
+			double v = values[r * nbins + k];
+			snprintf(sa, sizeof(sa), "%.*f", decimals, v);
+			sb[format_fixed(sb, v, decimals)] = 0;
+			if (strcmp(sa, sb)) diff++;
+		}
+	}
+
+	double before = measure(row_printf, a, values, nbins, nrows, decimals);
+	double after = measure(row_fixed, b, values, nbins, nrows, decimals);
+
+	printf("%i bins, %i decimals\n", nbins, decimals);
+	printf("printf:       %10.0f rows/s\n", before);
+	printf("format_fixed: %10.0f rows/s (%.1fx)\n", after, after / before);
+	printf("values that differ from printf: %i of %i\n", diff, 16 * nbins);
+
+	free(values);
+	free(a);
+	free(b);
+	return 0;
+}
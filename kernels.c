@@ -0,0 +1,771 @@
+/*
+    Vector kernels for the spectrum calculation. The best implementation for
+    the CPU we run on is selected at runtime by kernels_init().
+
+    Copyright (C) 2015  Steffen Kühn / steffen.kuehn@em-sys-dev.de
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include <math.h>
+#include <float.h>
+#include <string.h>
+#include "kernels.h"
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define HAVE_X86_KERNELS
+#endif
+
+#if defined(__aarch64__)
+#include <arm_neon.h>
+#define HAVE_NEON_KERNELS
+#endif
+
+// The vector kernels are written once with these macros, for double or,
+// with SPEC_FLOAT, for float. W is the number of values in one register.
+#ifdef SPEC_FLOAT
+#define AVX2_W 8
+#define AVX2_VEC __m256
+#define AVX2_LOAD _mm256_loadu_ps
+#define AVX2_STORE _mm256_storeu_ps
+#define AVX2_ADD _mm256_add_ps
+#define AVX2_MUL _mm256_mul_ps
+#define AVX2_SQRT _mm256_sqrt_ps
+#define AVX2_SET1 _mm256_set1_ps
+#define AVX2_SUB _mm256_sub_ps
+#define AVX2_DIV _mm256_div_ps
+#define AVX2_AND _mm256_and_ps
+#define AVX2_CMP _mm256_cmp_ps
+#define AVX2_BLENDV _mm256_blendv_ps
+#define AVX512_W 16
+#define AVX512_VEC __m512
+#define AVX512_LOAD _mm512_loadu_ps
+#define AVX512_STORE _mm512_storeu_ps
+#define AVX512_ADD _mm512_add_ps
+#define AVX512_MUL _mm512_mul_ps
+#define AVX512_SQRT _mm512_sqrt_ps
+#define NEON_W 4
+#define NEON_VEC float32x4_t
+#define NEON_LOAD vld1q_f32
+#define NEON_STORE vst1q_f32
+#define NEON_MUL vmulq_f32
+#define NEON_FMA vfmaq_f32
+#define NEON_SQRT vsqrtq_f32
+#define NEON_SET1 vdupq_n_f32
+#define NEON_ADD vaddq_f32
+#define NEON_SUB vsubq_f32
+#define NEON_DIV vdivq_f32
+#define NEON_MASK uint32x4_t
+#define NEON_CGT vcgtq_f32
+#define NEON_BSL vbslq_f32
+#else
+#define AVX2_W 4
+#define AVX2_VEC __m256d
+#define AVX2_LOAD _mm256_loadu_pd
+#define AVX2_STORE _mm256_storeu_pd
+#define AVX2_ADD _mm256_add_pd
+#define AVX2_MUL _mm256_mul_pd
+#define AVX2_SQRT _mm256_sqrt_pd
+#define AVX2_SET1 _mm256_set1_pd
+#define AVX2_SUB _mm256_sub_pd
+#define AVX2_DIV _mm256_div_pd
+#define AVX2_AND _mm256_and_pd
+#define AVX2_CMP _mm256_cmp_pd
+#define AVX2_BLENDV _mm256_blendv_pd
+#define AVX512_W 8
+#define AVX512_VEC __m512d
+#define AVX512_LOAD _mm512_loadu_pd
+#define AVX512_STORE _mm512_storeu_pd
+#define AVX512_ADD _mm512_add_pd
+#define AVX512_MUL _mm512_mul_pd
+#define AVX512_SQRT _mm512_sqrt_pd
+#define NEON_W 2
+#define NEON_VEC float64x2_t
+#define NEON_LOAD vld1q_f64
+#define NEON_STORE vst1q_f64
+#define NEON_MUL vmulq_f64
+#define NEON_FMA vfmaq_f64
+#define NEON_SQRT vsqrtq_f64
+#define NEON_SET1 vdupq_n_f64
+#define NEON_ADD vaddq_f64
+#define NEON_SUB vsubq_f64
+#define NEON_DIV vdivq_f64
+#define NEON_MASK uint64x2_t
+#define NEON_CGT vcgtq_f64
+#define NEON_BSL vbslq_f64
+#endif
+
+typedef void (*mag_fn)(const spec_real* re, const spec_real* im, spec_real* dst, int n);
+typedef void (*window_fn)(const spec_real* src, const spec_real* w, spec_real* dst, int n);
+typedef void (*convert_i32_fn)(const int32_t* src, const spec_real* w, spec_real* dst, int n);
+typedef void (*convert_i16_fn)(const int16_t* src, const spec_real* w, spec_real* dst, int n);
+typedef void (*encode_log16_fn)(const float* src, uint16_t* dst, int n, float offset, float scale);
+typedef void (*decode_log16_fn)(const uint16_t* src, float* dst, int n, float offset, float scale);
+
+// The log16 kernels work in float whatever spec_real is. log2(x) of
+// x = m * 2^e with m in [sqrt(1/2), sqrt(2)) is e + 2 / ln(2) * atanh(s),
+// s = (m - 1) / (m + 1), |s| < 0.172, which the odd series up to s^7
+// gives to 2e-8. 2^y = 2^i * 2^f with i = round(y) and |f| <= 1/2, the
+// Taylor series of exp(f ln(2)) up to f^7 gives 2^f to 1e-8.
+#define LOG2_C1 2.8853900817779268f // 2 / ln(2)
+#define LOG2_C3 0.9617966939259756f // 2 / (3 ln(2))
+#define LOG2_C5 0.5770780163555854f
+#define LOG2_C7 0.4121985831111324f
+#define EXP2_C1 0.6931471805599453f // ln(2)^k / k!
+#define EXP2_C2 0.2402265069591007f
+#define EXP2_C3 0.0555041086648216f
+#define EXP2_C4 0.0096181291076285f
+#define EXP2_C5 0.0013333558146428f
+#define EXP2_C6 0.0001540353039338f
+#define EXP2_C7 0.0000152527338040f
+#define LOG16_MAX 65535.0f
+
+// The dB kernels take log2 the same way, but in spec_real: for double the
+// series goes up to s^17 (error 2e-16). 10 log10(p) = 10 log10(2) log2(p).
+#ifdef SPEC_FLOAT
+#define LOG2_TERMS 4
+#else
+#define LOG2_TERMS 9
+#endif
+static const spec_real log2_series[LOG2_TERMS] = {
+	2.8853900817779268, 0.9617966939259757, 0.5770780163555853, 0.41219858311113244, // 2 / (k ln(2))
+#ifndef SPEC_FLOAT
+	0.3205988979753252, 0.2623081892525388, 0.2219530832136867, 0.19235933878519512,
+	0.16972882833987804
+#endif
+};
+#define DB_PER_LOG2 3.010299956639812 // 10 log10(2)
+#define DB_MIN_POWER 1e-30 // powers up to it (exact zeros included) give DB_FLOOR
+#define DB_FLOOR -300.0
+
+// plain C, used for the tails of the vector kernels too
+static void amplitude_c(const spec_real* re, const spec_real* im, spec_real* dst, int n)
+{
+	for (int k = 0;k < n;k++)
+	{
+		dst[k] = sqrt(re[k] * re[k] + im[k] * im[k]);
+	}
+}
+
+static void power_c(const spec_real* re, const spec_real* im, spec_real* dst, int n)
+{
+	for (int k = 0;k < n;k++)
+	{
+		dst[k] = re[k] * re[k] + im[k] * im[k];
+	}
+}
+
+static void decibel_c(const spec_real* re, const spec_real* im, spec_real* dst, int n)
+{
+	power_c(re, im, dst, n);
+	for (int k = 0;k < n;k++)
+	{
+		dst[k] = (dst[k] > DB_MIN_POWER) ? 10.0 * log10(dst[k]) : DB_FLOOR;
+	}
+}
+
+static void window_c(const spec_real* src, const spec_real* w, spec_real* dst, int n)
+{
+	for (int k = 0;k < n;k++)
+	{
+		dst[k] = src[k] * w[k];
+	}
+}
+
+static void convert_i32_c(const int32_t* src, const spec_real* w, spec_real* dst, int n)
+{
+	for (int k = 0;k < n;k++)
+	{
+		dst[k] = src[k] * w[k];
+	}
+}
+
+static void convert_i16_c(const int16_t* src, const spec_real* w, spec_real* dst, int n)
+{
+	for (int k = 0;k < n;k++)
+	{
+		dst[k] = src[k] * w[k];
+	}
+}
+
+static uint16_t encode_log16_one(float v, float offset, float scale)
+{
+	// zero, negative, denormal and nan
+	if (!(v >= FLT_MIN)) return 0;
+
+	uint32_t bits;
+	memcpy(&bits, &v, sizeof(bits));
+	int e = (int)(bits >> 23) - 127;
+	bits = (bits & 0x7fffff) | 0x3f800000;
+	float m;
+	memcpy(&m, &bits, sizeof(m));
+	if (m > (float)M_SQRT2)
+	{
+		m *= 0.5f;
+		e++;
+	}
+
+	float s = (m - 1.0f) / (m + 1.0f);
+	float s2 = s * s;
+	float y = e + s * (LOG2_C1 + s2 * (LOG2_C3 + s2 * (LOG2_C5 + s2 * LOG2_C7)));
+	float q = (y - offset) * (1.0f / scale) + 0.5f;
+
+	if (q < 1.0f) return 1;
+	if (q > LOG16_MAX) return 65535;
+	return (uint16_t)q;
+}
+
+static float decode_log16_one(uint16_t c, float offset, float scale)
+{
+	if (c == 0) return 0.0f;
+
+	float y = offset + c * scale;
+	float r = rintf(y);
+	float f = y - r;
+	float p = 1.0f + f * (EXP2_C1 + f * (EXP2_C2 + f * (EXP2_C3 + f * (EXP2_C4 +
+		f * (EXP2_C5 + f * (EXP2_C6 + f * EXP2_C7))))));
+
+	// 2^i, 0 below the normal floats, inf above them
+	int i = (int)r;
+	if (i < -126) return 0.0f;
+	if (i > 127) i = 128;
+	uint32_t bits = (uint32_t)(i + 127) << 23;
+	float p2;
+	memcpy(&p2, &bits, sizeof(p2));
+	return p * p2;
+}
+
+static void encode_log16_c(const float* src, uint16_t* dst, int n, float offset, float scale)
+{
+	for (int k = 0;k < n;k++)
+	{
+		dst[k] = encode_log16_one(src[k], offset, scale);
+	}
+}
+
+static void decode_log16_c(const uint16_t* src, float* dst, int n, float offset, float scale)
+{
+	for (int k = 0;k < n;k++)
+	{
+		dst[k] = decode_log16_one(src[k], offset, scale);
+	}
+}
+
+#ifdef HAVE_X86_KERNELS
+__attribute__((target("avx2")))
+static void amplitude_avx2(const spec_real* re, const spec_real* im, spec_real* dst, int n)
+{
+	int k = 0;
+	for (;k + AVX2_W <= n;k += AVX2_W)
+	{
+		AVX2_VEC r = AVX2_LOAD(re + k);
+		AVX2_VEC i = AVX2_LOAD(im + k);
+		AVX2_STORE(dst + k, AVX2_SQRT(AVX2_ADD(AVX2_MUL(r, r), AVX2_MUL(i, i))));
+	}
+	amplitude_c(re + k, im + k, dst + k, n - k);
+}
+
+__attribute__((target("avx2")))
+static void power_avx2(const spec_real* re, const spec_real* im, spec_real* dst, int n)
+{
+	int k = 0;
+	for (;k + AVX2_W <= n;k += AVX2_W)
+	{
+		AVX2_VEC r = AVX2_LOAD(re + k);
+		AVX2_VEC i = AVX2_LOAD(im + k);
+		AVX2_STORE(dst + k, AVX2_ADD(AVX2_MUL(r, r), AVX2_MUL(i, i)));
+	}
+	power_c(re + k, im + k, dst + k, n - k);
+}
+
+// No AVX-512 flavour, the spectra are short next to the transforms.
+__attribute__((target("avx2")))
+static void decibel_avx2(const spec_real* re, const spec_real* im, spec_real* dst, int n)
+{
+	const AVX2_VEC one = AVX2_SET1(1.0);
+	int k = 0;
+	for (;k + AVX2_W <= n;k += AVX2_W)
+	{
+		AVX2_VEC r = AVX2_LOAD(re + k);
+		AVX2_VEC i = AVX2_LOAD(im + k);
+		AVX2_VEC v = AVX2_ADD(AVX2_MUL(r, r), AVX2_MUL(i, i));
+
+		// v = m * 2^e with m in [1, 2), v is not negative
+#ifdef SPEC_FLOAT
+		__m256i bits = _mm256_castps_si256(v);
+		__m256 e = _mm256_cvtepi32_ps(_mm256_sub_epi32(_mm256_srli_epi32(bits, 23), _mm256_set1_epi32(127)));
+		__m256 m = _mm256_castsi256_ps(_mm256_or_si256(_mm256_and_si256(bits,
+			_mm256_set1_epi32(0x7fffff)), _mm256_set1_epi32(0x3f800000)));
+#else
+		// the exponent bits as the mantissa of 2^52 give 2^52 + biased e
+		__m256i bits = _mm256_castpd_si256(v);
+		__m256d e = _mm256_sub_pd(_mm256_castsi256_pd(_mm256_or_si256(_mm256_srli_epi64(bits, 52),
+			_mm256_set1_epi64x(0x4330000000000000))), _mm256_set1_pd(4503599627370496.0 + 1023.0));
+		__m256d m = _mm256_castsi256_pd(_mm256_or_si256(_mm256_and_si256(bits,
+			_mm256_set1_epi64x(0x000fffffffffffff)), _mm256_set1_epi64x(0x3ff0000000000000)));
+#endif
+
+		// m > sqrt(2): m / 2 and e + 1
+		AVX2_VEC big = AVX2_CMP(m, AVX2_SET1(M_SQRT2), _CMP_GT_OQ);
+		m = AVX2_BLENDV(m, AVX2_MUL(m, AVX2_SET1(0.5)), big);
+		e = AVX2_ADD(e, AVX2_AND(big, one));
+
+		AVX2_VEC s = AVX2_DIV(AVX2_SUB(m, one), AVX2_ADD(m, one));
+		AVX2_VEC s2 = AVX2_MUL(s, s);
+		AVX2_VEC p = AVX2_SET1(log2_series[LOG2_TERMS - 1]);
+		for (int j = LOG2_TERMS - 2;j >= 0;j--) p = AVX2_ADD(AVX2_SET1(log2_series[j]), AVX2_MUL(s2, p));
+		AVX2_VEC db = AVX2_MUL(AVX2_ADD(e, AVX2_MUL(s, p)), AVX2_SET1(DB_PER_LOG2));
+
+		AVX2_VEC valid = AVX2_CMP(v, AVX2_SET1(DB_MIN_POWER), _CMP_GT_OQ);
+		AVX2_STORE(dst + k, AVX2_BLENDV(AVX2_SET1(DB_FLOOR), db, valid));
+	}
+	decibel_c(re + k, im + k, dst + k, n - k);
+}
+
+__attribute__((target("avx2")))
+static void window_avx2(const spec_real* src, const spec_real* w, spec_real* dst, int n)
+{
+	int k = 0;
+	for (;k + AVX2_W <= n;k += AVX2_W)
+	{
+		AVX2_STORE(dst + k, AVX2_MUL(AVX2_LOAD(src + k), AVX2_LOAD(w + k)));
+	}
+	window_c(src + k, w + k, dst + k, n - k);
+}
+
+// The integer conversions have no AVX-512 flavour, they are bound by
+// memory anyway.
+__attribute__((target("avx2")))
+static void convert_i32_avx2(const int32_t* src, const spec_real* w, spec_real* dst, int n)
+{
+	int k = 0;
+	for (;k + AVX2_W <= n;k += AVX2_W)
+	{
+#ifdef SPEC_FLOAT
+		__m256 v = _mm256_cvtepi32_ps(_mm256_loadu_si256((const __m256i*)(src + k)));
+#else
+		__m256d v = _mm256_cvtepi32_pd(_mm_loadu_si128((const __m128i*)(src + k)));
+#endif
+		AVX2_STORE(dst + k, AVX2_MUL(v, AVX2_LOAD(w + k)));
+	}
+	convert_i32_c(src + k, w + k, dst + k, n - k);
+}
+
+__attribute__((target("avx2")))
+static void convert_i16_avx2(const int16_t* src, const spec_real* w, spec_real* dst, int n)
+{
+	int k = 0;
+	for (;k + AVX2_W <= n;k += AVX2_W)
+	{
+#ifdef SPEC_FLOAT
+		__m256i i = _mm256_cvtepi16_epi32(_mm_loadu_si128((const __m128i*)(src + k)));
+		__m256 v = _mm256_cvtepi32_ps(i);
+#else
+		__m128i i = _mm_cvtepi16_epi32(_mm_loadl_epi64((const __m128i*)(src + k)));
+		__m256d v = _mm256_cvtepi32_pd(i);
+#endif
+		AVX2_STORE(dst + k, AVX2_MUL(v, AVX2_LOAD(w + k)));
+	}
+	convert_i16_c(src + k, w + k, dst + k, n - k);
+}
+
+// The log16 kernels have no AVX-512 flavour either, 8 values per step are
+// far more than the write stage needs.
+__attribute__((target("avx2")))
+static void encode_log16_avx2(const float* src, uint16_t* dst, int n, float offset, float scale)
+{
+	const __m256 one = _mm256_set1_ps(1.0f);
+	const __m256 inv = _mm256_set1_ps(1.0f / scale);
+	int k = 0;
+	for (;k + 8 <= n;k += 8)
+	{
+		__m256 v = _mm256_loadu_ps(src + k);
+		__m256i bits = _mm256_castps_si256(v);
+		__m256i e = _mm256_sub_epi32(_mm256_and_si256(_mm256_srli_epi32(bits, 23),
+			_mm256_set1_epi32(0xff)), _mm256_set1_epi32(127));
+		__m256 m = _mm256_castsi256_ps(_mm256_or_si256(_mm256_and_si256(bits,
+			_mm256_set1_epi32(0x7fffff)), _mm256_set1_epi32(0x3f800000)));
+
+		// m > sqrt(2): m / 2 and e + 1 (the mask is -1)
+		__m256 big = _mm256_cmp_ps(m, _mm256_set1_ps((float)M_SQRT2), _CMP_GT_OQ);
+		m = _mm256_blendv_ps(m, _mm256_mul_ps(m, _mm256_set1_ps(0.5f)), big);
+		e = _mm256_sub_epi32(e, _mm256_castps_si256(big));
+
+		__m256 s = _mm256_div_ps(_mm256_sub_ps(m, one), _mm256_add_ps(m, one));
+		__m256 s2 = _mm256_mul_ps(s, s);
+		__m256 p = _mm256_add_ps(_mm256_set1_ps(LOG2_C5), _mm256_mul_ps(s2, _mm256_set1_ps(LOG2_C7)));
+		p = _mm256_add_ps(_mm256_set1_ps(LOG2_C3), _mm256_mul_ps(s2, p));
+		p = _mm256_add_ps(_mm256_set1_ps(LOG2_C1), _mm256_mul_ps(s2, p));
+		__m256 y = _mm256_add_ps(_mm256_cvtepi32_ps(e), _mm256_mul_ps(s, p));
+
+		__m256 q = _mm256_add_ps(_mm256_mul_ps(_mm256_sub_ps(y, _mm256_set1_ps(offset)), inv),
+			_mm256_set1_ps(0.5f));
+		q = _mm256_min_ps(_mm256_max_ps(q, one), _mm256_set1_ps(LOG16_MAX));
+		__m256 valid = _mm256_cmp_ps(v, _mm256_set1_ps(FLT_MIN), _CMP_GE_OQ);
+		__m256i c = _mm256_and_si256(_mm256_cvttps_epi32(q), _mm256_castps_si256(valid));
+
+		__m128i c16 = _mm_packus_epi32(_mm256_castsi256_si128(c), _mm256_extracti128_si256(c, 1));
+		_mm_storeu_si128((__m128i*)(dst + k), c16);
+	}
+	encode_log16_c(src + k, dst + k, n - k, offset, scale);
+}
+
+__attribute__((target("avx2")))
+static void decode_log16_avx2(const uint16_t* src, float* dst, int n, float offset, float scale)
+{
+	int k = 0;
+	for (;k + 8 <= n;k += 8)
+	{
+		__m256i c = _mm256_cvtepu16_epi32(_mm_loadu_si128((const __m128i*)(src + k)));
+		__m256 y = _mm256_add_ps(_mm256_set1_ps(offset),
+			_mm256_mul_ps(_mm256_cvtepi32_ps(c), _mm256_set1_ps(scale)));
+		__m256 r = _mm256_round_ps(y, _MM_FROUND_TO_NEAREST_INT | _MM_FROUND_NO_EXC);
+		__m256 f = _mm256_sub_ps(y, r);
+
+		__m256 p = _mm256_add_ps(_mm256_set1_ps(EXP2_C6), _mm256_mul_ps(f, _mm256_set1_ps(EXP2_C7)));
+		p = _mm256_add_ps(_mm256_set1_ps(EXP2_C5), _mm256_mul_ps(f, p));
+		p = _mm256_add_ps(_mm256_set1_ps(EXP2_C4), _mm256_mul_ps(f, p));
+		p = _mm256_add_ps(_mm256_set1_ps(EXP2_C3), _mm256_mul_ps(f, p));
+		p = _mm256_add_ps(_mm256_set1_ps(EXP2_C2), _mm256_mul_ps(f, p));
+		p = _mm256_add_ps(_mm256_set1_ps(EXP2_C1), _mm256_mul_ps(f, p));
+		p = _mm256_add_ps(_mm256_set1_ps(1.0f), _mm256_mul_ps(f, p));
+
+		// 2^i with i in -127 (gives 0) .. 128 (gives inf)
+		__m256i i = _mm256_cvtps_epi32(r);
+		i = _mm256_min_epi32(_mm256_max_epi32(i, _mm256_set1_epi32(-127)), _mm256_set1_epi32(128));
+		__m256 p2 = _mm256_castsi256_ps(_mm256_slli_epi32(_mm256_add_epi32(i, _mm256_set1_epi32(127)), 23));
+		__m256 v = _mm256_mul_ps(p, p2);
+
+		// code 0 is 0
+		__m256i zero = _mm256_cmpeq_epi32(c, _mm256_setzero_si256());
+		_mm256_storeu_ps(dst + k, _mm256_andnot_ps(_mm256_castsi256_ps(zero), v));
+	}
+	decode_log16_c(src + k, dst + k, n - k, offset, scale);
+}
+
+__attribute__((target("avx512f")))
+static void amplitude_avx512(const spec_real* re, const spec_real* im, spec_real* dst, int n)
+{
+	int k = 0;
+	for (;k + AVX512_W <= n;k += AVX512_W)
+	{
+		AVX512_VEC r = AVX512_LOAD(re + k);
+		AVX512_VEC i = AVX512_LOAD(im + k);
+		AVX512_STORE(dst + k, AVX512_SQRT(AVX512_ADD(AVX512_MUL(r, r), AVX512_MUL(i, i))));
+	}
+	amplitude_c(re + k, im + k, dst + k, n - k);
+}
+
+__attribute__((target("avx512f")))
+static void power_avx512(const spec_real* re, const spec_real* im, spec_real* dst, int n)
+{
+	int k = 0;
+	for (;k + AVX512_W <= n;k += AVX512_W)
+	{
+		AVX512_VEC r = AVX512_LOAD(re + k);
+		AVX512_VEC i = AVX512_LOAD(im + k);
+		AVX512_STORE(dst + k, AVX512_ADD(AVX512_MUL(r, r), AVX512_MUL(i, i)));
+	}
+	power_c(re + k, im + k, dst + k, n - k);
+}
+
+__attribute__((target("avx512f")))
+static void window_avx512(const spec_real* src, const spec_real* w, spec_real* dst, int n)
+{
+	int k = 0;
+	for (;k + AVX512_W <= n;k += AVX512_W)
+	{
+		AVX512_STORE(dst + k, AVX512_MUL(AVX512_LOAD(src + k), AVX512_LOAD(w + k)));
+	}
+	window_c(src + k, w + k, dst + k, n - k);
+}
+#endif
+
+#ifdef HAVE_NEON_KERNELS
+static void amplitude_neon(const spec_real* re, const spec_real* im, spec_real* dst, int n)
+{
+	int k = 0;
+	for (;k + NEON_W <= n;k += NEON_W)
+	{
+		NEON_VEC r = NEON_LOAD(re + k);
+		NEON_VEC i = NEON_LOAD(im + k);
+		NEON_STORE(dst + k, NEON_SQRT(NEON_FMA(NEON_MUL(r, r), i, i)));
+	}
+	amplitude_c(re + k, im + k, dst + k, n - k);
+}
+
+static void power_neon(const spec_real* re, const spec_real* im, spec_real* dst, int n)
+{
+	int k = 0;
+	for (;k + NEON_W <= n;k += NEON_W)
+	{
+		NEON_VEC r = NEON_LOAD(re + k);
+		NEON_VEC i = NEON_LOAD(im + k);
+		NEON_STORE(dst + k, NEON_FMA(NEON_MUL(r, r), i, i));
+	}
+	power_c(re + k, im + k, dst + k, n - k);
+}
+
+static void decibel_neon(const spec_real* re, const spec_real* im, spec_real* dst, int n)
+{
+	const NEON_VEC one = NEON_SET1(1.0);
+	int k = 0;
+	for (;k + NEON_W <= n;k += NEON_W)
+	{
+		NEON_VEC r = NEON_LOAD(re + k);
+		NEON_VEC i = NEON_LOAD(im + k);
+		NEON_VEC v = NEON_FMA(NEON_MUL(r, r), i, i);
+
+		// v = m * 2^e with m in [1, 2), v is not negative
+#ifdef SPEC_FLOAT
+		uint32x4_t bits = vreinterpretq_u32_f32(v);
+		float32x4_t e = vcvtq_f32_s32(vsubq_s32(vreinterpretq_s32_u32(vshrq_n_u32(bits, 23)),
+			vdupq_n_s32(127)));
+		float32x4_t m = vreinterpretq_f32_u32(vorrq_u32(vandq_u32(bits, vdupq_n_u32(0x7fffff)),
+			vdupq_n_u32(0x3f800000)));
+#else
+		uint64x2_t bits = vreinterpretq_u64_f64(v);
+		float64x2_t e = vcvtq_f64_s64(vsubq_s64(vreinterpretq_s64_u64(vshrq_n_u64(bits, 52)),
+			vdupq_n_s64(1023)));
+		float64x2_t m = vreinterpretq_f64_u64(vorrq_u64(vandq_u64(bits, vdupq_n_u64(0x000fffffffffffffULL)),
+			vdupq_n_u64(0x3ff0000000000000ULL)));
+#endif
+
+		// m > sqrt(2): m / 2 and e + 1
+		NEON_MASK big = NEON_CGT(m, NEON_SET1(M_SQRT2));
+		m = NEON_BSL(big, NEON_MUL(m, NEON_SET1(0.5)), m);
+		e = NEON_BSL(big, NEON_ADD(e, one), e);
+
+		NEON_VEC s = NEON_DIV(NEON_SUB(m, one), NEON_ADD(m, one));
+		NEON_VEC s2 = NEON_MUL(s, s);
+		NEON_VEC p = NEON_SET1(log2_series[LOG2_TERMS - 1]);
+		for (int j = LOG2_TERMS - 2;j >= 0;j--) p = NEON_FMA(NEON_SET1(log2_series[j]), s2, p);
+		NEON_VEC db = NEON_MUL(NEON_FMA(e, s, p), NEON_SET1(DB_PER_LOG2));
+
+		NEON_MASK valid = NEON_CGT(v, NEON_SET1(DB_MIN_POWER));
+		NEON_STORE(dst + k, NEON_BSL(valid, db, NEON_SET1(DB_FLOOR)));
+	}
+	decibel_c(re + k, im + k, dst + k, n - k);
+}
+
+static void window_neon(const spec_real* src, const spec_real* w, spec_real* dst, int n)
+{
+	int k = 0;
+	for (;k + NEON_W <= n;k += NEON_W)
+	{
+		NEON_STORE(dst + k, NEON_MUL(NEON_LOAD(src + k), NEON_LOAD(w + k)));
+	}
+	window_c(src + k, w + k, dst + k, n - k);
+}
+
+static void convert_i32_neon(const int32_t* src, const spec_real* w, spec_real* dst, int n)
+{
+	int k = 0;
+	for (;k + 4 <= n;k += 4)
+	{
+		int32x4_t i = vld1q_s32(src + k);
+#ifdef SPEC_FLOAT
+		vst1q_f32(dst + k, vmulq_f32(vcvtq_f32_s32(i), vld1q_f32(w + k)));
+#else
+		float64x2_t lo = vcvtq_f64_s64(vmovl_s32(vget_low_s32(i)));
+		float64x2_t hi = vcvtq_f64_s64(vmovl_high_s32(i));
+		vst1q_f64(dst + k, vmulq_f64(lo, vld1q_f64(w + k)));
+		vst1q_f64(dst + k + 2, vmulq_f64(hi, vld1q_f64(w + k + 2)));
+#endif
+	}
+	convert_i32_c(src + k, w + k, dst + k, n - k);
+}
+
+static void convert_i16_neon(const int16_t* src, const spec_real* w, spec_real* dst, int n)
+{
+	int k = 0;
+	for (;k + 4 <= n;k += 4)
+	{
+		int32x4_t i = vmovl_s16(vld1_s16(src + k));
+#ifdef SPEC_FLOAT
+		vst1q_f32(dst + k, vmulq_f32(vcvtq_f32_s32(i), vld1q_f32(w + k)));
+#else
+		float64x2_t lo = vcvtq_f64_s64(vmovl_s32(vget_low_s32(i)));
+		float64x2_t hi = vcvtq_f64_s64(vmovl_high_s32(i));
+		vst1q_f64(dst + k, vmulq_f64(lo, vld1q_f64(w + k)));
+		vst1q_f64(dst + k + 2, vmulq_f64(hi, vld1q_f64(w + k + 2)));
+#endif
+	}
+	convert_i16_c(src + k, w + k, dst + k, n - k);
+}
+
+static void encode_log16_neon(const float* src, uint16_t* dst, int n, float offset, float scale)
+{
+	const float32x4_t one = vdupq_n_f32(1.0f);
+	int k = 0;
+	for (;k + 4 <= n;k += 4)
+	{
+		float32x4_t v = vld1q_f32(src + k);
+		uint32x4_t bits = vreinterpretq_u32_f32(v);
+		int32x4_t e = vsubq_s32(vreinterpretq_s32_u32(vandq_u32(vshrq_n_u32(bits, 23),
+			vdupq_n_u32(0xff))), vdupq_n_s32(127));
+		float32x4_t m = vreinterpretq_f32_u32(vorrq_u32(vandq_u32(bits, vdupq_n_u32(0x7fffff)),
+			vdupq_n_u32(0x3f800000)));
+
+		// m > sqrt(2): m / 2 and e + 1 (the mask is -1)
+		uint32x4_t big = vcgtq_f32(m, vdupq_n_f32((float)M_SQRT2));
+		m = vbslq_f32(big, vmulq_f32(m, vdupq_n_f32(0.5f)), m);
+		e = vsubq_s32(e, vreinterpretq_s32_u32(big));
+
+		float32x4_t s = vdivq_f32(vsubq_f32(m, one), vaddq_f32(m, one));
+		float32x4_t s2 = vmulq_f32(s, s);
+		float32x4_t p = vfmaq_f32(vdupq_n_f32(LOG2_C5), s2, vdupq_n_f32(LOG2_C7));
+		p = vfmaq_f32(vdupq_n_f32(LOG2_C3), s2, p);
+		p = vfmaq_f32(vdupq_n_f32(LOG2_C1), s2, p);
+		float32x4_t y = vfmaq_f32(vcvtq_f32_s32(e), s, p);
+
+		float32x4_t q = vfmaq_f32(vdupq_n_f32(0.5f), vsubq_f32(y, vdupq_n_f32(offset)),
+			vdupq_n_f32(1.0f / scale));
+		q = vminq_f32(vmaxq_f32(q, one), vdupq_n_f32(LOG16_MAX));
+		uint32x4_t valid = vcgeq_f32(v, vdupq_n_f32(FLT_MIN));
+		uint32x4_t c = vandq_u32(vcvtq_u32_f32(q), valid);
+
+		vst1_u16(dst + k, vmovn_u32(c));
+	}
+	encode_log16_c(src + k, dst + k, n - k, offset, scale);
+}
+
+static void decode_log16_neon(const uint16_t* src, float* dst, int n, float offset, float scale)
+{
+	int k = 0;
+	for (;k + 4 <= n;k += 4)
+	{
+		uint32x4_t c = vmovl_u16(vld1_u16(src + k));
+		float32x4_t y = vfmaq_f32(vdupq_n_f32(offset), vcvtq_f32_u32(c), vdupq_n_f32(scale));
+		float32x4_t r = vrndnq_f32(y);
+		float32x4_t f = vsubq_f32(y, r);
+
+		float32x4_t p = vfmaq_f32(vdupq_n_f32(EXP2_C6), f, vdupq_n_f32(EXP2_C7));
+		p = vfmaq_f32(vdupq_n_f32(EXP2_C5), f, p);
+		p = vfmaq_f32(vdupq_n_f32(EXP2_C4), f, p);
+		p = vfmaq_f32(vdupq_n_f32(EXP2_C3), f, p);
+		p = vfmaq_f32(vdupq_n_f32(EXP2_C2), f, p);
+		p = vfmaq_f32(vdupq_n_f32(EXP2_C1), f, p);
+		p = vfmaq_f32(vdupq_n_f32(1.0f), f, p);
+
+		// 2^i with i in -127 (gives 0) .. 128 (gives inf)
+		int32x4_t i = vcvtq_s32_f32(r);
+		i = vminq_s32(vmaxq_s32(i, vdupq_n_s32(-127)), vdupq_n_s32(128));
+		float32x4_t p2 = vreinterpretq_f32_s32(vshlq_n_s32(vaddq_s32(i, vdupq_n_s32(127)), 23));
+		float32x4_t v = vmulq_f32(p, p2);
+
+		// code 0 is 0
+		uint32x4_t zero = vceqq_u32(c, vdupq_n_u32(0));
+		vst1q_f32(dst + k, vreinterpretq_f32_u32(vbicq_u32(vreinterpretq_u32_f32(v), zero)));
+	}
+	decode_log16_c(src + k, dst + k, n - k, offset, scale);
+}
+#endif
+
+static mag_fn amplitude_fn = amplitude_c;
+static mag_fn power_fn = power_c;
+static mag_fn decibel_fn = decibel_c;
+static window_fn window_kernel = window_c;
+static convert_i32_fn convert_i32_kernel = convert_i32_c;
+static convert_i16_fn convert_i16_kernel = convert_i16_c;
+static encode_log16_fn encode_log16_kernel = encode_log16_c;
+static decode_log16_fn decode_log16_kernel = decode_log16_c;
+
+const char* kernels_init(void)
+{
+#ifdef HAVE_X86_KERNELS
+	__builtin_cpu_init();
+	if (__builtin_cpu_supports("avx512f"))
+	{
+		amplitude_fn = amplitude_avx512;
+		power_fn = power_avx512;
+		decibel_fn = decibel_avx2;
+		window_kernel = window_avx512;
+		convert_i32_kernel = convert_i32_avx2;
+		convert_i16_kernel = convert_i16_avx2;
+		encode_log16_kernel = encode_log16_avx2;
+		decode_log16_kernel = decode_log16_avx2;
+		return "AVX-512";
+	}
+	if (__builtin_cpu_supports("avx2"))
+	{
+		amplitude_fn = amplitude_avx2;
+		power_fn = power_avx2;
+		decibel_fn = decibel_avx2;
+		window_kernel = window_avx2;
+		convert_i32_kernel = convert_i32_avx2;
+		convert_i16_kernel = convert_i16_avx2;
+		encode_log16_kernel = encode_log16_avx2;
+		decode_log16_kernel = decode_log16_avx2;
+		return "AVX2";
+	}
+#endif
+#ifdef HAVE_NEON_KERNELS
+	// every AArch64 CPU has NEON
+	amplitude_fn = amplitude_neon;
+	power_fn = power_neon;
+	decibel_fn = decibel_neon;
+	window_kernel = window_neon;
+	convert_i32_kernel = convert_i32_neon;
+	convert_i16_kernel = convert_i16_neon;
+	encode_log16_kernel = encode_log16_neon;
+	decode_log16_kernel = decode_log16_neon;
+	return "NEON";
+#endif
+	return "none";
+}
+
+void calc_magnitude(const spec_real* re, const spec_real* im, spec_real* dst, int n, int kind)
+{
+	if (kind == MAG_AMPLITUDE)
+	{
+		amplitude_fn(re, im, dst, n);
+		return;
+	}
+
+	if (kind == MAG_DB)
+	{
+		// -300 dB instead of -inf for an exact zero
+		decibel_fn(re, im, dst, n);
+		return;
+	}
+
+	power_fn(re, im, dst, n);
+}
+
+void apply_window(const spec_real* src, const spec_real* w, spec_real* dst, int n)
+{
+	window_kernel(src, w, dst, n);
+}
+
+void convert_i32(const int32_t* src, const spec_real* w, spec_real* dst, int n)
+{
+	convert_i32_kernel(src, w, dst, n);
+}
+
+void convert_i16(const int16_t* src, const spec_real* w, spec_real* dst, int n)
+{
+	convert_i16_kernel(src, w, dst, n);
+}
+
+void encode_log16(const float* src, uint16_t* dst, int n, float offset, float scale)
+{
+	encode_log16_kernel(src, dst, n, offset, scale);
+}
+
+void decode_log16(const uint16_t* src, float* dst, int n, float offset, float scale)
+{
+	decode_log16_kernel(src, dst, n, offset, scale);
+}
@@ -0,0 +1,60 @@
+/*
+    Vector kernels for the spectrum calculation. The best implementation for
+    the CPU we run on is selected at runtime by kernels_init().
+
+    Copyright (C) 2015  Steffen Kühn / steffen.kuehn@em-sys-dev.de
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef KERNELS_H
+#define KERNELS_H
+
+#include <stdint.h>
+
+// precision of the whole pipeline, "make FLOAT=1" defines SPEC_FLOAT
+#ifdef SPEC_FLOAT
+typedef float spec_real;
+#else
+typedef double spec_real;
+#endif
+
+// what calc_magnitude() produces from a complex spectrum
+#define MAG_AMPLITUDE 0 // |X|
+#define MAG_POWER 1     // |X|^2
+#define MAG_DB 2        // 10 * log10(|X|^2)
+
+// selects the kernels for this CPU, returns the name of the instruction set
+const char* kernels_init(void);
+
+// dst[k] = magnitude of re[k] + j * im[k] for 0 <= k < n
+void calc_magnitude(const spec_real* re, const spec_real* im, spec_real* dst, int n, int kind);
+
+// dst[k] = src[k] * w[k] for 0 <= k < n
+void apply_window(const spec_real* src, const spec_real* w, spec_real* dst, int n);
+
+// dst[k] = src[k] * w[k] for raw integer samples; w holds the window times
+// the value of one count
+void convert_i32(const int32_t* src, const spec_real* w, spec_real* dst, int n);
+void convert_i16(const int16_t* src, const spec_real* w, spec_real* dst, int n);
+
+// dst[k] = code of src[k] on a log scale: 0 for values below 2^-126 (zero
+// included), else round((log2(src[k]) - offset) / scale), limited to
+// 1..65535
+void encode_log16(const float* src, uint16_t* dst, int n, float offset, float scale);
+
+// dst[k] = 2^(offset + src[k] * scale), 0 for the code 0
+void decode_log16(const uint16_t* src, float* dst, int n, float offset, float scale);
+
+#endif
@@ -23,23 +23,126 @@
 
 #include <glib.h>
 #include <stdio.h>
+#include <stdlib.h>
 #include <phidget21.h>
 #include <unistd.h>
 #include <sndfile.h>
 #include <libgen.h>
 #include <string.h>
-#include <rfftw.h>
 #include <math.h>
+#include <float.h>
+#include <time.h>
+#include <signal.h>
+#include <poll.h>
+#include <sys/eventfd.h>
+#include <sys/mman.h>
+#include <sys/uio.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <stdarg.h>
+#include "kernels.h"
+#include "sdft.h"
+#include "realtime.h"
+#include "queue.h"
+#include "format.h"
+#include "specfile.h"
+
+// "make FLOAT=1" switches the buffers, the transforms and the wav file to
+// single precision, see spec_real
+#ifdef USE_FFTW3
+#include <fftw3.h>
+#ifdef SPEC_FLOAT
+#define FFTW(name) fftwf_##name
+#else
+#define FFTW(name) fftw_##name
+#endif
+typedef spec_real fftw_real;
+typedef FFTW(plan) spec_plan;
+#define SPEC_FORWARD FFTW_FORWARD
+#else
+#ifdef SPEC_FLOAT
+#include <srfftw.h>
+#else
+#include <rfftw.h>
+#endif
+typedef rfftw_plan spec_plan;
+#define SPEC_FORWARD FFTW_REAL_TO_COMPLEX
+#endif
+
+#ifdef SPEC_FLOAT
+#define WAV_FORMAT SF_FORMAT_FLOAT
+#define sf_write_real sf_write_float
+#else
+#define WAV_FORMAT SF_FORMAT_DOUBLE
+#define sf_write_real sf_write_double
+#endif
 
 #define STR_HELPER(x) #x
 #define STR(x) STR_HELPER(x)
 
 #define DEFAULT_OUTPUT_DIR "."
 #define OUTPUT_MARKER "accel"
+#define MAX_DAY_FILES 99 // archives of one day with different settings, see day_file()
+#define CLOCK_RESYNC_US (60 * G_USEC_PER_SEC) // device time between adjustments to the wall clock
+#define CLOCK_SLEW_MAX_US 30000 // most one adjustment moves the timestamps (500 ppm)
+#define CLOCK_STEP_US G_USEC_PER_SEC // larger offsets are taken over at once
 #define MAX_G 0.005 // 1.0 in wav is this value in g
 #define DEFAULT_MAX_FREQ 150
 #define DEFAULT_AVERAGE_INTERVAL_IN_SECONDS 10
-#define PIPELINE_LEN 100
+#define DEFAULT_PIPELINE_SECONDS 100
+#define MIN_SLACK_SEGMENTS 10 // ring segments beyond the history of one block
+#define PLAN_CACHE_SIZE 4
+#define TRACK_QUEUE_LEN 1024 // rows of tracked bins between callback and process()
+#define TRACK_FLUSH_ROWS 100 // write the tracked bins in batches of this many rows
+#define DEFAULT_TRACK_INTERVAL_MS 10
+#define WAKEUP_TIMEOUT_MS 1000 // process() runs at least this often
+#define WAV_CHUNK 64 // frames per sf_write call
+#define DEFAULT_DECIMALS 6
+#define ROW_TIME_MAX 32 // chars of the timestamp of a csv row
+#define WRITE_BATCH_ROWS 64 // rows the write stage collects before it writes
+#define ARENA_ALIGN 64 // cache line, every plane and spectrum row starts on one
+#define HUGE_PAGE_SIZE (2 << 20)
+#define MAX_BATCH_BLOCKS 16 // blocks the worker pool transforms in one go
+#define SPEC_QUEUE_LEN 64 // block spectra between the transform and the aggregate stage
+#define ROW_QUEUE_LEN 64 // rows between the aggregate and the write stage
+#define SLOT_HEADER ARENA_ALIGN // bytes of a queue slot before its values, see slot_info
+#define DEFAULT_RT_PRIORITY 80 // of the callback, the processing threads get one less
+
+// storage of the samples in the ring, see store_sample()
+#define SAMPLE_REAL 0 // fftw_real in g
+#define SAMPLE_INT32 1 // counts of lsb g
+#define SAMPLE_INT16 2
+#define DEFAULT_LSB_INT32 (1.0 / (1 << 24)) // +-128 g
+#define DEFAULT_LSB_INT16 (1.0 / (1 << 14)) // +-2 g, 61 ug
+
+// what the producer does when the consumer falls behind, see begin_segment()
+#define OVERFLOW_DROP_NEWEST 0 // drop the incoming samples until there is room
+#define OVERFLOW_DROP_OLDEST 1 // overwrite the oldest segments not yet processed
+#define OVERFLOW_SPILL 2 // queue the incoming segments in a file
+#define DEFAULT_SPILL_LIMIT_MB 1024
+#define SPILL_QUEUE_LEN 16 // segments on their way to the spill file
+
+// what the write stage writes the spectra to
+#define OUTPUT_CSV 0 // a text file per axis
+#define OUTPUT_SPEC 1 // one binary archive, see specfile.h
+#define DEFAULT_LOG_STEP_DB 0.05 // quantization step of --encoding log16
+
+// when the write stage calls fdatasync() on the csv files
+#define SYNC_NEVER 0 // leave it to the kernel
+#define SYNC_ROWS 1 // every --sync-every rows of a file
+#define SYNC_SECONDS 2 // every --sync-every seconds
+#define DEFAULT_SYNC_EVERY 10
+
+// where the samples of the current segment go
+#define DEST_RING 0
+#define DEST_SPILL 1
+#define DEST_DROP 2
+
+#define TAG_BUSY G_MAXUINT64 // slot is being written, see ring.tags
+
+// spectrum engines, chosen by --engine in check_options()
+#define SPEC_ENGINE_FFT 0
+#define SPEC_ENGINE_GOERTZEL 1
 
 static SNDFILE* wavfile = 0;
 static SF_INFO sfinfo = {0};
@@ -48,17 +151,212 @@ static gboolean info_only = FALSE;
 static int samplerate = 1000;
 static int maxfreq = DEFAULT_MAX_FREQ;
 static int avg_int_in_sec = DEFAULT_AVERAGE_INTERVAL_IN_SECONDS;
-static int rbufi = 0;
-static fftw_real*** inbuf = NULL;
-static gboolean unproc[PIPELINE_LEN] = {0};
-static int ibptr = 0;
-static int aind = 0;
-static fftw_real*** ampspec = NULL;
+static int fft_size = 0; // transform length N, 0 means samplerate
+static int hop = 0; // samples from one block to the next, 0 means fft_size
+static int navg = 0; // blocks per averaging interval
+static fftw_real* fftin[3] = {NULL}; // one block per axis, input of the transform
+static int aind = 0; // blocks in acc (aggregate stage)
+static double* acc = NULL; // sum or maximum of the spectra of 3 axes
+static guint64 acc_lost = 0;
+static gint64 acc_time = 0; // end of the last block added to acc
+static int spec_stride = 0; // nbins, padded to ARENA_ALIGN
 static gboolean max_instead_of_avg = FALSE;
 static gboolean wav = FALSE;
 static double moving_average[3] = {0};
 static double tau = 10.0;// time in seconds in which the moving average is down to 0.5
 static double avgconst = 0;
+static char* wisdom_file = NULL;
+static gboolean patient = FALSE;
+static int plan_flags = FFTW_ESTIMATE;
+static volatile sig_atomic_t quit = 0;
+static char* engine_name = "auto";
+static int spec_engine = SPEC_ENGINE_FFT;
+static int nbins = 0; // number of spectrum bins we compute and write
+static fftw_real* goertzel_coef = NULL;
+static char* spectrum_name = "amplitude";
+static int mag_kind = MAG_AMPLITUDE;
+static char* window_name = "rect";
+static int overlap = 0; // percent
+static fftw_real* window = NULL; // NULL for the rectangular window
+static double window_gain = 0; // sum of the window, N for the rectangular one
+static char** track_freqs = NULL;
+static int track_interval_ms = DEFAULT_TRACK_INTERVAL_MS;
+static int ntracks = 0; // number of tracked bins per axis
+static sdft* tracker[3] = {NULL};
+static int track_countdown = 0; // samples until the next row of tracked bins
+static gint64* track_time = NULL; // TRACK_QUEUE_LEN rows ...
+static fftw_real* track_values = NULL; // ... of 3 * ntracks values ...
+static int* track_gap = NULL; // ... and the rows dropped before each of them
+static int track_head = 0; // written by the callback
+static int track_tail = 0; // written by process()
+static int track_lost = 0; // rows dropped because the queue was full (callback)
+static int track_pending_lost = 0; // dropped since the last queued row (callback)
+
+// a growing text buffer
+typedef struct
+{
+	char* p;
+	size_t len, size;
+} text_buf;
+
+// An output file of the write stage, open until the day changes. Rows are
+// collected in rows and written in batches by flush_file().
+typedef struct
+{
+	int fd;
+	int day; // yyyymmdd
+	text_buf header; // of the kind of file, made once
+	gboolean head_pending; // the file is new, the header goes first
+	text_buf rows;
+	gboolean failed;
+	gboolean dirty; // written since the last fdatasync()
+	int unsynced_rows;
+	gint64 synced; // monotonic time of the last fdatasync()
+	off_t end; // size of the file up to the last complete batch
+	int refused_day; // no file of this day could be continued, see day_file()
+} output_file;
+
+#define OUTPUT_FILE_INIT {-1, 0, {NULL, 0, 0}, FALSE, {NULL, 0, 0}, FALSE, FALSE, 0, 0, 0, 0}
+static output_file csv_files[3] = {OUTPUT_FILE_INIT, OUTPUT_FILE_INIT, OUTPUT_FILE_INIT}; // x, y, z
+static output_file track_file = OUTPUT_FILE_INIT;
+static output_file spec_out = OUTPUT_FILE_INIT; // --format spec, all axes
+static specfile_info spec_info;
+static float* spec_values = NULL; // nbins, a row converted for the archive
+static char* output_format_name = "csv";
+static int output_format = OUTPUT_CSV;
+static char* encoding_name = "float32";
+static int encoding = SPECFILE_FLOAT32;
+static double log_step_db = DEFAULT_LOG_STEP_DB;
+static char* sync_name = "never";
+static int sync_policy = SYNC_NEVER;
+static int sync_every = DEFAULT_SYNC_EVERY;
+static int decimals = DEFAULT_DECIMALS;
+
+static char* sample_format_name = "real";
+static int sample_format = SAMPLE_REAL;
+static int sample_size = sizeof(fftw_real);
+static double lsb = 0; // g per count for the integer formats
+static double counts_per_g = 0;
+static fftw_real* wscale = NULL; // window times lsb for the integer formats
+static char* layout_name = "planar";
+static gboolean interleaved = FALSE;
+static gboolean huge_pages = FALSE;
+static void* arena = NULL; // sample ring and spectra in one allocation
+static size_t arena_size = 0;
+static gboolean arena_mapped = FALSE; // from mmap(), else from posix_memalign()
+static int nthreads = 1; // workers for the transforms, 1 means no pool
+static GThreadPool* pool = NULL;
+static fftw_real* job_in = NULL; // 3 * MAX_BATCH_BLOCKS blocks for the pool ...
+static int job_stride = 0; // ... this many elements apart (fft_size, padded)
+static GMutex jobs_lock;
+static GCond jobs_done;
+static int jobs_left = 0;
+static gboolean realtime = FALSE;
+static char* rt_policy_name = "fifo";
+static int rt_policy = SCHED_FIFO;
+static int rt_priority = DEFAULT_RT_PRIORITY;
+static char* callback_cpus = NULL;
+static char* process_cpus = NULL;
+static __thread gboolean rt_thread_ready = FALSE; // rt_setup_thread() done for this thread
+static char* overflow_name = "drop-newest";
+static int overflow_policy = OVERFLOW_DROP_NEWEST;
+static int spill_limit_mb = DEFAULT_SPILL_LIMIT_MB;
+static int pipeline_seconds = 0; // 0: DEFAULT_PIPELINE_SECONDS, or all the budget
+static int memory_budget_mb = 0; // 0: no limit
+static guint64 consumer_lost = 0; // samples the consumer lost, see skip_overwritten()
+static guint64 consumer_lost_segs = 0;
+static guint64 lost_reported = 0; // lost samples up to the last block
+static int stats_interval = 0; // seconds between queue reports, 0 for none
+
+// Sample ring between the Phidget callback (the only producer) and
+// process() (the only consumer). It holds nsegs segments of hop samples per
+// axis. head counts the completed segments and is only written by the
+// producer, tail counts the consumed ones and is only written by the
+// consumer. Each side publishes its counter with a release store and reads
+// the other one with an acquire load, so no lock is needed. Segment number
+// q lives in slot q % nsegs.
+// The samples live in the arena. Sample pos of axis i is element
+// i * axis_stride + pos * step of data: planar, every axis has its own
+// plane (axis_stride = padded len, step = 1); interleaved, the axes of one
+// sample are neighbours (axis_stride = 1, step = 3).
+// With OVERFLOW_DROP_OLDEST the producer does not wait for the consumer.
+// Every slot then has a tag like a seqlock: TAG_BUSY while the producer
+// writes it, the segment number afterwards. The consumer checks the tags of
+// a block before and after it copies it, see fetch_block().
+typedef struct
+{
+	void* data; // see sample_format
+	gint64* times; // nsegs, wall clock of the first sample of the segment in us
+	guint64* tags; // nsegs, OVERFLOW_DROP_OLDEST only
+	int axis_stride;
+	int step;
+	int nsegs; // number of hop-long segments
+	int len; // nsegs * hop samples per axis
+	int history; // older segments a block reaches back into
+	guint64 head;
+	guint64 tail;
+	int fill; // samples in segment head so far (producer only)
+	int dest; // where segment head goes (producer only)
+	gboolean overflow; // producer only
+	guint64 lost; // samples the producer dropped, only written by it
+	guint64 lost_segs;
+} sample_ring;
+
+static sample_ring ring = {NULL};
+static int wakeup_fd = -1; // eventfd, signalled by the producer per segment
+
+// Overflow queue on disk for OVERFLOW_SPILL. While the consumer is behind,
+// the producer collects whole segments in the slots of out instead of the
+// ring, and the spill thread writes them to the file, so that the callback
+// never waits for the disk. The consumer copies them back into the ring once
+// there is room again, and during that time it also advances ring.head (the
+// producer does not touch the ring until the queue is empty). head and tail
+// count the segments written and read back; segment q is at
+// (q - base) * rec_size in the file. A record is the 3 planes of samples
+// followed by the time of the segment.
+typedef struct
+{
+	int fd;
+	void* buf; // the segment being collected, a slot of out (producer)
+	void* rbuf; // the segment being read back (consumer)
+	size_t rec_size;
+	stage_queue out; // producer -> spill thread
+	void* slots; // memory of out
+	GThread* thread;
+	int stop;
+	guint64 head; // written by the spill thread
+	guint64 tail; // written by the consumer
+	guint64 base; // written by the producer while the queue is empty
+	guint64 lost_segs; // written by the spill thread, segments it could not write
+	gboolean active; // producer only
+} spill_queue;
+
+static spill_queue spill = {-1, NULL, NULL, 0, {NULL, 0, 0, 0, 0, -1, -1}};
+
+// The processing runs in stages: the transform stage (main thread) takes
+// blocks from the ring and puts their spectra into spec_queue, the
+// aggregate stage averages them into rows for row_queue and the write stage
+// puts the rows into the files. A slow disk fills row_queue first, then
+// spec_queue and only then the ring. Every slot starts with a slot_info,
+// its values follow at SLOT_HEADER, see slot_values().
+typedef struct
+{
+	guint64 lost; // samples lost before this block (during this row)
+	gint64 time; // wall clock of the end of the block (row) in us
+} slot_info;
+
+static stage_queue spec_queue = {NULL, 0, 0, 0, 0, -1, -1};
+static stage_queue row_queue = {NULL, 0, 0, 0, 0, -1, -1};
+static GThread* aggregate_thread = NULL;
+static GThread* write_thread = NULL;
+static int stages_stop = 0; // no more blocks for the aggregate stage
+static int aggregate_done = 0; // no more rows for the write stage
+static int ring_high = 0; // most segments seen waiting in the ring
+static gint64 time_base = 0; // wall clock minus device clock in us (callback)
+static gint64 last_device_time = -1;
+static gint64 next_resync = 0; // device time of the next adjustment of time_base
+static gint64 least_offset = 0; // of wall and device clock since the last one
+static gint64 last_block_time = 0; // transform stage
 
 static GOptionEntry entries[] = {
 	{
@@ -85,234 +383,2096 @@ static GOptionEntry entries[] = {
 		"wav", 'w', 0, G_OPTION_ARG_NONE, &wav,
 		"store wav file too", NULL
 	},
+	{
+		"fft-size", 'N', 0, G_OPTION_ARG_INT, &fft_size,
+		"transform length in samples, default: sample rate (1 s blocks)", "N"
+	},
+	{
+		"hop", 'H', 0, G_OPTION_ARG_INT, &hop,
+		"samples from the start of one block to the next, default: transform length", "N"
+	},
+	{
+		"window", 'W', 0, G_OPTION_ARG_STRING, &window_name,
+		"window function: rect, hann, hamming, blackman-harris or flattop, default: rect", "NAME"
+	},
+	{
+		"overlap", 'O', 0, G_OPTION_ARG_INT, &overlap,
+		"overlap of the blocks in percent (Welch), e.g. 50 or 75, sets the hop size", "PERCENT"
+	},
+	{
+		"track", 't', 0, G_OPTION_ARG_STRING_ARRAY, &track_freqs,
+		"track this frequency in Hz after every sample (sliding DFT), can be repeated", "FREQ"
+	},
+	{
+		"track-interval", 0, 0, G_OPTION_ARG_INT, &track_interval_ms,
+		"write the tracked frequencies every this many ms, default: " STR(DEFAULT_TRACK_INTERVAL_MS), "MS"
+	},
+	{
+		"sample-format", 0, 0, G_OPTION_ARG_STRING, &sample_format_name,
+		"sample storage in the pipeline: real, int32 or int16, default: real", "FORMAT"
+	},
+	{
+		"lsb", 0, 0, G_OPTION_ARG_DOUBLE, &lsb,
+		"g per count for int32/int16 samples, default: 2^-24 (int32), 2^-14 (int16)", "G"
+	},
+	{
+		"threads", 0, 0, G_OPTION_ARG_INT, &nthreads,
+		"worker threads for the transforms, 0 for one per CPU, default: 1", "N"
+	},
+	{
+		"realtime", 0, 0, G_OPTION_ARG_NONE, &realtime,
+		"lock the memory and run the callback and the processing under realtime scheduling", NULL
+	},
+	{
+		"rt-policy", 0, 0, G_OPTION_ARG_STRING, &rt_policy_name,
+		"realtime scheduling policy: fifo or rr, default: fifo", "POLICY"
+	},
+	{
+		"rt-priority", 0, 0, G_OPTION_ARG_INT, &rt_priority,
+		"realtime priority of the callback, processing runs one below, default: " STR(DEFAULT_RT_PRIORITY), "PRIO"
+	},
+	{
+		"callback-cpus", 0, 0, G_OPTION_ARG_STRING, &callback_cpus,
+		"with --realtime, run the sensor callback on these CPUs, e.g. 3 or 2-3", "CPUS"
+	},
+	{
+		"process-cpus", 0, 0, G_OPTION_ARG_STRING, &process_cpus,
+		"with --realtime, run the processing and the workers on these CPUs, e.g. 0-2", "CPUS"
+	},
+	{
+		"pipeline-seconds", 0, 0, G_OPTION_ARG_INT, &pipeline_seconds,
+		"seconds of samples the ring holds while processing is behind, default: " STR(DEFAULT_PIPELINE_SECONDS) " or what fits into --memory-budget", "S"
+	},
+	{
+		"memory-budget", 0, 0, G_OPTION_ARG_INT, &memory_budget_mb,
+		"MB for the sample ring and the spectra, limits --pipeline-seconds", "MB"
+	},
+	{
+		"stats", 0, 0, G_OPTION_ARG_INT, &stats_interval,
+		"print the depths of the ring and the stage queues every this many seconds", "S"
+	},
+	{
+		"overflow", 0, 0, G_OPTION_ARG_STRING, &overflow_name,
+		"if processing falls behind: drop-newest, drop-oldest or spill (to a file in the output dir), default: drop-newest", "POLICY"
+	},
+	{
+		"spill-limit", 0, 0, G_OPTION_ARG_INT, &spill_limit_mb,
+		"size of the spill file in MB, newer samples are dropped beyond, default: " STR(DEFAULT_SPILL_LIMIT_MB), "MB"
+	},
+	{
+		"format", 0, 0, G_OPTION_ARG_STRING, &output_format_name,
+		"output of the spectra: csv (a file per axis) or spec (one binary archive per day), default: csv", "FORMAT"
+	},
+	{
+		"encoding", 0, 0, G_OPTION_ARG_STRING, &encoding_name,
+		"values of --format spec: float32 or log16 (16 bit on a log scale, amplitude and power only), default: float32", "ENC"
+	},
+	{
+		"log-step", 0, 0, G_OPTION_ARG_DOUBLE, &log_step_db,
+		"step of --encoding log16 in dB, the error is half of it, default: " STR(DEFAULT_LOG_STEP_DB), "DB"
+	},
+	{
+		"decimals", 0, 0, G_OPTION_ARG_INT, &decimals,
+		"decimals of the values in the csv files, 0 to " STR(FORMAT_MAX_DECIMALS) ", default: " STR(DEFAULT_DECIMALS), "N"
+	},
+	{
+		"sync", 0, 0, G_OPTION_ARG_STRING, &sync_name,
+		"fdatasync the csv files: never, rows (every N rows) or seconds (every N seconds), default: never", "POLICY"
+	},
+	{
+		"sync-every", 0, 0, G_OPTION_ARG_INT, &sync_every,
+		"N for --sync, default: " STR(DEFAULT_SYNC_EVERY), "N"
+	},
+	{
+		"layout", 0, 0, G_OPTION_ARG_STRING, &layout_name,
+		"sample ring layout: planar (one plane per axis) or interleaved (x, y, z per sample), default: planar", "LAYOUT"
+	},
+	{
+		"huge-pages", 0, 0, G_OPTION_ARG_NONE, &huge_pages,
+		"put the sample ring and the spectra on huge pages", NULL
+	},
+	{
+		"engine", 'e', 0, G_OPTION_ARG_STRING, &engine_name,
+		"spectrum engine: auto, fft or goertzel, default: auto", "NAME"
+	},
+	{
+		"spectrum", 's', 0, G_OPTION_ARG_STRING, &spectrum_name,
+		"values to store: amplitude, power or db, default: amplitude", "KIND"
+	},
+	{
+		"wisdom", 0, 0, G_OPTION_ARG_FILENAME, &wisdom_file,
+		"load FFTW wisdom from this file and save it on exit; missing plans are measured", "FILE"
+	},
+	{
+		"patient", 0, 0, G_OPTION_ARG_NONE, &patient,
+		"measure missing plans with FFTW_PATIENT instead of FFTW_MEASURE (FFTW3 only)", NULL
+	},
 	{ NULL}
 };
 
-static void calc_amplitude_spectrum(fftw_real* in, int N, fftw_real* amplitude_spectrum)
+// FFTW plans are expensive to create, so every plan is created once and kept
+// for the whole run. Plans are looked up by transform length, direction and
+// the number of transforms done in one batch (always 1 for FFTW2).
+typedef struct
 {
-	fftw_real out[N];
-	rfftw_plan p;
-	int k;
+	int n;
+	int dir;
+	int howmany;
+	spec_plan plan;
+} plan_cache_entry;
+
+G_STATIC_ASSERT(sizeof(fftw_real) == sizeof(spec_real));
+
+static plan_cache_entry plan_cache[PLAN_CACHE_SIZE];
+static int plan_cache_len = 0;
+
+#ifdef USE_FFTW3
+// split r2c output of all three axes, real and imaginary parts in separate
+// arrays so that the magnitude kernel reads both contiguously
+static fftw_real* specre = NULL;
+static fftw_real* specim = NULL;
+// split output of the pool jobs, job_cstride elements per job
+static fftw_real* job_re = NULL;
+static fftw_real* job_im = NULL;
+static int job_cstride = 0;
+
+static spec_plan create_plan(int n, int dir, int howmany)
+{
+	// FFTW3 needs arrays to plan with. The plan is executed later on other
+	// arrays from fftw_malloc(), which have the same (SIMD) alignment.
+	FFTW(iodim) dim = {n, 1, 1};
+	FFTW(iodim) batch = {howmany, n, n / 2 + 1};
+	fftw_real* in = FFTW(malloc)(sizeof(fftw_real) * n * howmany);
+	fftw_real* re = FFTW(malloc)(sizeof(fftw_real) * (n / 2 + 1) * howmany);
+	fftw_real* im = FFTW(malloc)(sizeof(fftw_real) * (n / 2 + 1) * howmany);
+	spec_plan p = NULL;
+
+	if (plan_flags != FFTW_ESTIMATE)
+	{
+		// try the loaded wisdom first, measuring may take minutes
+		p = FFTW(plan_guru_split_dft_r2c)(1, &dim, 1, &batch, in, re, im,
+			plan_flags | FFTW_WISDOM_ONLY);
+		if (!p)
+		{
+			printf("no FFT wisdom for N=%i, measuring plan...\n", n);
+		}
+	}
+	if (!p)
+	{
+		p = FFTW(plan_guru_split_dft_r2c)(1, &dim, 1, &batch, in, re, im, plan_flags);
+	}
+	FFTW(free)(in);
+	FFTW(free)(re);
+	FFTW(free)(im);
+	return p;
+}
+
+static void destroy_plan(spec_plan p)
+{
+	FFTW(destroy_plan)(p);
+}
 
-	p = rfftw_create_plan(N, FFTW_REAL_TO_COMPLEX, FFTW_ESTIMATE);
+static void load_wisdom(void)
+{
+	if (!wisdom_file) return;
 
-	rfftw_one(p, in, out);
-	amplitude_spectrum[0] = sqrt(out[0] * out[0]);// DC component
-	for (k = 1;k < (N + 1) / 2;++k) // (k < N/2 rounded up)
+	plan_flags = patient ? FFTW_PATIENT : FFTW_MEASURE;
+	if (!FFTW(import_wisdom_from_filename)(wisdom_file))
 	{
-		amplitude_spectrum[k] = sqrt(out[k] * out[k] + out[N - k] * out[N - k]);
+		printf("no usable FFT wisdom in %s\n", wisdom_file);
 	}
-	if (N % 2 == 0) // N is even
+}
+
+static void save_wisdom(void)
+{
+	// nothing loaded, nothing measured: keep the file as it is
+	if (!wisdom_file || (plan_flags == FFTW_ESTIMATE)) return;
+
+	if (!FFTW(export_wisdom_to_filename)(wisdom_file))
 	{
-		amplitude_spectrum[N / 2] = sqrt(out[N / 2] * out[N / 2]);// Nyquist freq.
+		printf("ERROR: could not write FFT wisdom file: %s\n", wisdom_file);
 	}
+}
+#else
+static spec_plan create_plan(int n, int dir, int howmany)
+{
+	// with FFTW_USE_WISDOM, FFTW2 only measures if the wisdom has no plan;
+	// the pool runs one plan in several threads at once, which FFTW2 only
+	// allows for plans made with FFTW_THREADSAFE
+	return rfftw_create_plan(n, dir, plan_flags | ((nthreads > 1) ? FFTW_THREADSAFE : 0));
+}
 
+static void destroy_plan(spec_plan p)
+{
 	rfftw_destroy_plan(p);
 }
 
-static void free_spec_buffers(void)
+static void load_wisdom(void)
+{
+	if (!wisdom_file) return;
+
+	// FFTW2 knows no FFTW_PATIENT
+	plan_flags = FFTW_MEASURE | FFTW_USE_WISDOM;
+
+	FILE* fp = fopen(wisdom_file, "r");
+	if (!fp || (fftw_import_wisdom_from_file(fp) != FFTW_SUCCESS))
+	{
+		printf("no usable FFT wisdom in %s\n", wisdom_file);
+	}
+	if (fp) fclose(fp);
+}
+
+static void save_wisdom(void)
+{
+	// nothing loaded, nothing measured: keep the file as it is
+	if (!wisdom_file || (plan_flags == FFTW_ESTIMATE)) return;
+
+	FILE* fp = fopen(wisdom_file, "w");
+	if (!fp)
+	{
+		printf("ERROR: could not write FFT wisdom file: %s\n", wisdom_file);
+		return;
+	}
+	fftw_export_wisdom_to_file(fp);
+	fclose(fp);
+}
+#endif
+
+static spec_plan get_plan(int n, int dir, int howmany)
 {
-	if (inbuf)
+	for (int i = 0;i < plan_cache_len;i++)
 	{
-		for (int j = 0;j < PIPELINE_LEN;j++)
+		if ((plan_cache[i].n == n) && (plan_cache[i].dir == dir) &&
+			(plan_cache[i].howmany == howmany))
 		{
-			for (int i = 0;i < 3;i++) g_free(inbuf[j][i]);
-			g_free(inbuf[j]);
+			return plan_cache[i].plan;
 		}
-		g_free(inbuf);
-		inbuf = NULL;
 	}
 
-	if (ampspec)
+	if (plan_cache_len == PLAN_CACHE_SIZE)
 	{
-		for (int i = 0;i < 3;i++)
+		printf("ERROR: FFT plan cache is full\n");
+		return NULL;
+	}
+
+	plan_cache[plan_cache_len].n = n;
+	plan_cache[plan_cache_len].dir = dir;
+	plan_cache[plan_cache_len].howmany = howmany;
+	plan_cache[plan_cache_len].plan = create_plan(n, dir, howmany);
+	return plan_cache[plan_cache_len++].plan;
+}
+
+static void free_plans(void)
+{
+	for (int i = 0;i < plan_cache_len;i++)
+	{
+		destroy_plan(plan_cache[i].plan);
+	}
+	plan_cache_len = 0;
+}
+
+#ifdef USE_FFTW3
+// in[0], in[1] and in[2] have to be consecutive parts of one fftw_malloc() block
+static void calc_amplitude_spectra(fftw_real** in, int N, fftw_real** amplitude_spectrum)
+{
+	FFTW(execute_split_dft_r2c)(get_plan(N, SPEC_FORWARD, 3), in[0], specre, specim);
+
+	for (int i = 0;i < 3;i++)
+	{
+		calc_magnitude(specre + i * (N / 2 + 1), specim + i * (N / 2 + 1),
+			amplitude_spectrum[i], nbins, mag_kind);
+	}
+}
+#else
+static void calc_amplitude_spectrum(rfftw_plan p, fftw_real* in, int N, fftw_real* amplitude_spectrum)
+{
+	fftw_real out[N];
+	fftw_real im[nbins];
+
+	rfftw_one(p, in, out);
+
+	// The halfcomplex output holds the imaginary parts backwards at the end
+	// of the array. Turn them around, then out[] and im[] are read forwards.
+	im[0] = 0;// DC component
+	for (int k = 1;k < nbins;k++) // nbins - 1 <= N/2
+	{
+		im[k] = (k < (N + 1) / 2) ? out[N - k] : 0; // 0 for the Nyquist freq.
+	}
+
+	calc_magnitude(out, im, amplitude_spectrum, nbins, mag_kind);
+}
+
+static void calc_amplitude_spectra(fftw_real** in, int N, fftw_real** amplitude_spectrum)
+{
+	rfftw_plan p = get_plan(N, SPEC_FORWARD, 1);
+	for (int i = 0;i < 3;i++)
+	{
+		calc_amplitude_spectrum(p, in[i], N, amplitude_spectrum[i]);
+	}
+}
+#endif
+
+// Goertzel filter bank for the bins 0..nbins-1. Four bins run side by side,
+// so that the four recursions do not wait for each other.
+static void calc_goertzel_spectrum(fftw_real* in, int N, fftw_real* amplitude_spectrum)
+{
+	for (int k = 0;k < nbins;k += 4)
+	{
+		double c[4], s1[4] = {0}, s2[4] = {0};
+		int m = MIN(4, nbins - k);
+
+		for (int b = 0;b < 4;b++) c[b] = (b < m) ? goertzel_coef[k + b] : 0.0;
+
+		for (int n = 0;n < N;n++)
+		{
+			for (int b = 0;b < 4;b++)
+			{
+				double s0 = in[n] + c[b] * s1[b] - s2[b];
+				s2[b] = s1[b];
+				s1[b] = s0;
+			}
+		}
+
+		for (int b = 0;b < m;b++)
 		{
-			for (int j = 0;j < avg_int_in_sec;j++)
+			double p = MAX(s1[b] * s1[b] + s2[b] * s2[b] - c[b] * s1[b] * s2[b], 0.0);
+			if (mag_kind == MAG_AMPLITUDE)
+			{
+				p = sqrt(p);
+			}
+			else if (mag_kind == MAG_DB)
 			{
-				g_free(ampspec[i][j]);
+				p = (p > 1e-30) ? 10.0 * log10(p) : -300.0;
 			}
+			amplitude_spectrum[k + b] = p;
 		}
-		g_free(ampspec);
-		ampspec = NULL;
 	}
 }
 
-static void alloc_spec_buffers(void)
+static void calc_spectra(fftw_real** in, int N, fftw_real** amplitude_spectrum)
 {
-	free_spec_buffers();
-	inbuf = g_new0(fftw_real**, PIPELINE_LEN);
-	for (int j = 0;j < PIPELINE_LEN;j++)
+	if (spec_engine == SPEC_ENGINE_GOERTZEL)
 	{
-		inbuf[j] = g_new0(fftw_real*, 3);
 		for (int i = 0;i < 3;i++)
 		{
-			inbuf[j][i] = g_new0(fftw_real, samplerate);
+			calc_goertzel_spectrum(in[i], N, amplitude_spectrum[i]);
 		}
 	}
-	ampspec = g_new0(fftw_real**, 3);
-	for (int i = 0;i < 3;i++)
+	else
+	{
+		calc_amplitude_spectra(in, N, amplitude_spectrum);
+	}
+}
+
+// One axis of one block, done by the worker pool. The slot selects the
+// input and scratch buffers of the job.
+typedef struct
+{
+	int slot;
+	fftw_real* out;
+} spec_job;
+
+static spec_job jobs[3 * MAX_BATCH_BLOCKS];
+
+static void calc_axis_spectrum(int slot, fftw_real* out)
+{
+	fftw_real* in = job_in + (size_t)slot * job_stride;
+
+	if (spec_engine == SPEC_ENGINE_GOERTZEL)
+	{
+		calc_goertzel_spectrum(in, fft_size, out);
+		return;
+	}
+	// all plans exist already, get_plan() only looks them up here
+#ifdef USE_FFTW3
+	fftw_real* re = job_re + (size_t)slot * job_cstride;
+	fftw_real* im = job_im + (size_t)slot * job_cstride;
+	FFTW(execute_split_dft_r2c)(get_plan(fft_size, SPEC_FORWARD, 1), in, re, im);
+	calc_magnitude(re, im, out, nbins, mag_kind);
+#else
+	calc_amplitude_spectrum(get_plan(fft_size, SPEC_FORWARD, 1), in, fft_size, out);
+#endif
+}
+
+static void run_job(gpointer data, gpointer user_data)
+{
+	spec_job* job = data;
+
+	if (realtime && !rt_thread_ready)
+	{
+		rt_setup_thread("worker", rt_policy, rt_priority - 1, process_cpus);
+		rt_thread_ready = TRUE;
+	}
+
+	calc_axis_spectrum(job->slot, job->out);
+
+	g_mutex_lock(&jobs_lock);
+	if (--jobs_left == 0) g_cond_signal(&jobs_done);
+	g_mutex_unlock(&jobs_lock);
+}
+
+// Windows as sums of cosines: w[n] = a0 - a1 cos(x) + a2 cos(2x) - ..., with
+// x = 2 pi n / N (periodic form, as needed for spectral analysis)
+typedef struct
+{
+	const char* name;
+	double a[5];
+} window_def;
+
+static const window_def windows[] = {
+	{"rect", {1.0}},
+	{"hann", {0.5, 0.5}},
+	{"hamming", {0.54, 0.46}},
+	{"blackman-harris", {0.35875, 0.48829, 0.14128, 0.01168}},
+	{"flattop", {0.21557895, 0.41663158, 0.277263158, 0.083578947, 0.006947368}},
+};
+
+static const double* window_coefficients(const char* name)
+{
+	for (int i = 0;i < G_N_ELEMENTS(windows);i++)
+	{
+		if (!strcmp(windows[i].name, name)) return windows[i].a;
+	}
+	return NULL;
+}
+
+// precomputes the window table, the amplitudes are corrected by the sum of
+// the window so that a sine reads the same with every window
+static void make_window(void)
+{
+	const double* a = window_coefficients(window_name);
+
+	window_gain = fft_size;
+	if (!strcmp(window_name, "rect")) return;
+
+	window = g_new(fftw_real, fft_size);
+	window_gain = 0;
+	for (int n = 0;n < fft_size;n++)
 	{
-		ampspec[i] = g_new0(fftw_real*, avg_int_in_sec);
-		for (int j = 0;j < avg_int_in_sec;j++)
+		double w = 0, sign = 1;
+		for (int k = 0;k < 5;k++)
 		{
-			ampspec[i][j] = g_new0(fftw_real, samplerate / 2 + 1);
+			w += sign * a[k] * cos(2.0 * M_PI * k * n / fft_size);
+			sign = -sign;
 		}
+		window[n] = w;
+		window_gain += w;
 	}
 }
 
-static void open_output(void)
+static size_t align_up(size_t n, size_t a)
 {
-	alloc_spec_buffers();
+	return (n + a - 1) / a * a;
 }
 
-static gboolean does_file_exist(char* name)
+// a slot_info and three spectra of nbins values
+static size_t slot_bytes(void)
 {
-	gboolean exist = FALSE;
-	FILE* ofp = fopen(name, "r");
-	if (ofp != NULL)
+	return SLOT_HEADER + 3 * align_up(sizeof(fftw_real) * nbins, ARENA_ALIGN);
+}
+
+// bytes of the arena with a ring of nsegs segments, see alloc_spec_buffers()
+static size_t arena_bytes(int nsegs)
+{
+	size_t plane = align_up((size_t)sample_size * nsegs * hop, ARENA_ALIGN);
+	size_t tags = align_up(sizeof(guint64) * nsegs, ARENA_ALIGN);
+	return 3 * plane + 2 * tags + (SPEC_QUEUE_LEN + ROW_QUEUE_LEN) * slot_bytes();
+}
+
+// The ring holds pipeline_seconds of samples. A memory budget caps that,
+// and without --pipeline-seconds the ring takes all of the budget. It has
+// room for one block and MIN_SLACK_SEGMENTS at least.
+static gboolean size_ring(void)
+{
+	int min_segs = ring.history + MIN_SLACK_SEGMENTS;
+	int max_segs = G_MAXINT / hop / 3; // the sample indices are ints
+	int seconds = pipeline_seconds ? pipeline_seconds : DEFAULT_PIPELINE_SECONDS;
+
+	ring.nsegs = MAX((int)MIN(((gint64)seconds * samplerate + hop - 1) / hop, max_segs), min_segs);
+	if (memory_budget_mb > 0)
 	{
-		exist = TRUE;
-		fclose(ofp);
+		size_t budget = (size_t)memory_budget_mb << 20;
+		if (arena_bytes(min_segs) > budget)
+		{
+			printf("ERROR: a memory budget of %i MB is too small, %zu MB are needed at least\n",
+				memory_budget_mb, (arena_bytes(min_segs) >> 20) + 1);
+			return FALSE;
+		}
+
+		// the largest ring that fits, arena_bytes() grows with nsegs
+		int lo = min_segs, hi = pipeline_seconds ? ring.nsegs : max_segs;
+		while (lo < hi)
+		{
+			int mid = lo + (hi - lo + 1) / 2;
+			if (arena_bytes(mid) <= budget)
+			{
+				lo = mid;
+			}
+			else
+			{
+				hi = mid - 1;
+			}
+		}
+		ring.nsegs = lo;
+	}
+	ring.len = ring.nsegs * hop;
+
+	printf("sample ring: %.1f s in %i segments, %.1f MB\n", (double)ring.len / samplerate,
+		ring.nsegs, arena_bytes(ring.nsegs) / 1048576.0);
+	return TRUE;
+}
+
+// Only the bins 0..maxfreq are written. A Goertzel filter costs O(N) per bin
+// and an FFT O(N log N) for all bins, so with few bins Goertzel is cheaper.
+// (Chirp-z or zoom FFT do not pay off here: they need transforms of at least
+// the same length.)
+static gboolean check_options(void)
+{
+	if (fft_size == 0) fft_size = samplerate;
+	if ((overlap < 0) || (overlap >= 100) || (overlap && hop))
+	{
+		printf("ERROR: overlap must be 0..99 %% and cannot be combined with --hop\n");
+		return FALSE;
+	}
+	if (hop == 0) hop = fft_size - (fft_size * overlap) / 100;
+	if ((fft_size < 2) || (hop < 1))
+	{
+		printf("ERROR: invalid transform length or hop size\n");
+		return FALSE;
+	}
+
+	if (maxfreq < 0)
+	{
+		printf("ERROR: invalid max. frequency: %i Hz\n", maxfreq);
+		return FALSE;
+	}
+
+	// the bins are samplerate / fft_size Hz apart
+	nbins = MIN((int)((double)maxfreq * fft_size / samplerate), fft_size / 2) + 1;
+	navg = MAX(1, (int)lround((double)avg_int_in_sec * samplerate / hop));
+
+	// older segments one block reaches back into, see size_ring()
+	ring.history = (fft_size + hop - 1) / hop - 1;
+	if ((pipeline_seconds < 0) || (memory_budget_mb < 0))
+	{
+		printf("ERROR: invalid pipeline length or memory budget\n");
+		return FALSE;
+	}
+
+	if (!strcmp(engine_name, "fft"))
+	{
+		spec_engine = SPEC_ENGINE_FFT;
+	}
+	else if (!strcmp(engine_name, "goertzel"))
+	{
+		spec_engine = SPEC_ENGINE_GOERTZEL;
+	}
+	else if (!strcmp(engine_name, "auto"))
+	{
+		spec_engine = (nbins <= log2(fft_size)) ? SPEC_ENGINE_GOERTZEL : SPEC_ENGINE_FFT;
+	}
+	else
+	{
+		printf("ERROR: unknown spectrum engine: %s\n", engine_name);
+		return FALSE;
+	}
+
+	for (int t = 0;track_freqs && track_freqs[t];t++)
+	{
+		char* end;
+		double f = g_ascii_strtod(track_freqs[t], &end);
+		if ((end == track_freqs[t]) || *end || !(f >= 0) || (f > samplerate / 2.0))
+		{
+			printf("ERROR: invalid track frequency: %s, expected 0 to %g Hz\n",
+				track_freqs[t], samplerate / 2.0);
+			return FALSE;
+		}
+	}
+
+	if (!strcmp(sample_format_name, "real"))
+	{
+		sample_format = SAMPLE_REAL;
+		sample_size = sizeof(fftw_real);
+	}
+	else if (!strcmp(sample_format_name, "int32"))
+	{
+		sample_format = SAMPLE_INT32;
+		sample_size = sizeof(gint32);
+		if (lsb <= 0) lsb = DEFAULT_LSB_INT32;
+	}
+	else if (!strcmp(sample_format_name, "int16"))
+	{
+		sample_format = SAMPLE_INT16;
+		sample_size = sizeof(gint16);
+		if (lsb <= 0) lsb = DEFAULT_LSB_INT16;
+	}
+	else
+	{
+		printf("ERROR: unknown sample format: %s\n", sample_format_name);
+		return FALSE;
+	}
+	counts_per_g = (lsb > 0) ? 1.0 / lsb : 0;
+
+	if (nthreads == 0) nthreads = g_get_num_processors();
+	if (nthreads < 1)
+	{
+		printf("ERROR: invalid number of threads\n");
+		return FALSE;
+	}
+
+	if (realtime)
+	{
+		if (!strcmp(rt_policy_name, "fifo"))
+		{
+			rt_policy = SCHED_FIFO;
+		}
+		else if (!strcmp(rt_policy_name, "rr"))
+		{
+			rt_policy = SCHED_RR;
+		}
+		else
+		{
+			printf("ERROR: unknown realtime policy: %s\n", rt_policy_name);
+			return FALSE;
+		}
+
+		// the processing threads run at rt_priority - 1
+		if ((rt_priority <= sched_get_priority_min(rt_policy)) ||
+			(rt_priority > sched_get_priority_max(rt_policy)))
+		{
+			printf("ERROR: realtime priority must be %i..%i\n",
+				sched_get_priority_min(rt_policy) + 1, sched_get_priority_max(rt_policy));
+			return FALSE;
+		}
+
+		if ((callback_cpus && !rt_check_cpus(callback_cpus)) ||
+			(process_cpus && !rt_check_cpus(process_cpus)))
+		{
+			printf("ERROR: invalid CPU list, expected e.g. 3 or 0-2,5\n");
+			return FALSE;
+		}
+	}
+
+	if (!strcmp(overflow_name, "drop-newest"))
+	{
+		overflow_policy = OVERFLOW_DROP_NEWEST;
+	}
+	else if (!strcmp(overflow_name, "drop-oldest"))
+	{
+		overflow_policy = OVERFLOW_DROP_OLDEST;
+	}
+	else if (!strcmp(overflow_name, "spill"))
+	{
+		overflow_policy = OVERFLOW_SPILL;
+	}
+	else
+	{
+		printf("ERROR: unknown overflow policy: %s\n", overflow_name);
+		return FALSE;
+	}
+
+	if (!strcmp(sync_name, "never"))
+	{
+		sync_policy = SYNC_NEVER;
+	}
+	else if (!strcmp(sync_name, "rows"))
+	{
+		sync_policy = SYNC_ROWS;
+	}
+	else if (!strcmp(sync_name, "seconds"))
+	{
+		sync_policy = SYNC_SECONDS;
+	}
+	else
+	{
+		printf("ERROR: unknown sync policy: %s\n", sync_name);
+		return FALSE;
+	}
+	if (!strcmp(output_format_name, "csv"))
+	{
+		output_format = OUTPUT_CSV;
+	}
+	else if (!strcmp(output_format_name, "spec"))
+	{
+		output_format = OUTPUT_SPEC;
+	}
+	else
+	{
+		printf("ERROR: unknown output format: %s\n", output_format_name);
+		return FALSE;
+	}
+
+	if (!strcmp(encoding_name, "float32"))
+	{
+		encoding = SPECFILE_FLOAT32;
+	}
+	else if (!strcmp(encoding_name, "log16"))
+	{
+		encoding = SPECFILE_LOG16;
+	}
+	else
+	{
+		printf("ERROR: unknown encoding: %s\n", encoding_name);
+		return FALSE;
+	}
+	if (!(log_step_db >= 0.001) || (log_step_db > 1.0))
+	{
+		printf("ERROR: --log-step must be 0.001 to 1 dB\n");
+		return FALSE;
+	}
+
+	if ((decimals < 0) || (decimals > FORMAT_MAX_DECIMALS))
+	{
+		printf("ERROR: --decimals must be 0 to %i\n", FORMAT_MAX_DECIMALS);
+		return FALSE;
+	}
+	if (sync_every < 1)
+	{
+		printf("ERROR: --sync-every must be at least 1\n");
+		return FALSE;
+	}
+
+	if (!strcmp(layout_name, "planar"))
+	{
+		interleaved = FALSE;
+	}
+	else if (!strcmp(layout_name, "interleaved"))
+	{
+		interleaved = TRUE;
+	}
+	else
+	{
+		printf("ERROR: unknown layout: %s\n", layout_name);
+		return FALSE;
+	}
+
+	if (!window_coefficients(window_name))
+	{
+		printf("ERROR: unknown window: %s\n", window_name);
+		return FALSE;
+	}
+
+	if (!strcmp(spectrum_name, "amplitude"))
+	{
+		mag_kind = MAG_AMPLITUDE;
+	}
+	else if (!strcmp(spectrum_name, "power"))
+	{
+		mag_kind = MAG_POWER;
+	}
+	else if (!strcmp(spectrum_name, "db"))
+	{
+		mag_kind = MAG_DB;
+	}
+	else
+	{
+		printf("ERROR: unknown spectrum kind: %s\n", spectrum_name);
+		return FALSE;
+	}
+	if ((encoding == SPECFILE_LOG16) && ((output_format != OUTPUT_SPEC) || (mag_kind == MAG_DB)))
+	{
+		printf("ERROR: --encoding log16 needs --format spec and amplitude or power values\n");
+		return FALSE;
+	}
+
+	return size_ring();
+}
+
+// one zeroed, ARENA_ALIGN aligned block. With --huge-pages it comes from
+// the huge page pool if there is one, otherwise the kernel is asked to back
+// it with transparent huge pages.
+static void* alloc_arena(size_t size)
+{
+	void* p = NULL;
+
+	arena_mapped = FALSE;
+	if (huge_pages)
+	{
+		arena_size = align_up(size, HUGE_PAGE_SIZE);
+		p = mmap(NULL, arena_size, PROT_READ | PROT_WRITE,
+			MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+		if (p == MAP_FAILED)
+		{
+			printf("no huge pages reserved, using transparent huge pages\n");
+			p = mmap(NULL, arena_size, PROT_READ | PROT_WRITE,
+				MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+			if (p != MAP_FAILED) madvise(p, arena_size, MADV_HUGEPAGE);
+		}
+		if (p != MAP_FAILED)
+		{
+			arena_mapped = TRUE;
+			return p;
+		}
+		p = NULL;
+	}
+
+	arena_size = size;
+	if (posix_memalign(&p, ARENA_ALIGN, size))
+	{
+		g_error("could not allocate %zu bytes", size);
+	}
+	memset(p, 0, size);
+	return p;
+}
+
+static void free_arena(void)
+{
+	if (!arena) return;
+
+	if (arena_mapped)
+	{
+		munmap(arena, arena_size);
+	}
+	else
+	{
+		free(arena);
+	}
+	arena = NULL;
+	ring.data = NULL;
+	ring.times = NULL;
+	ring.tags = NULL;
+}
+
+// the values of axis dim in a slot of spec_queue or row_queue
+static inline fftw_real* slot_values(void* slot, int dim)
+{
+	return (fftw_real*)((char*)slot + SLOT_HEADER) + (size_t)dim * spec_stride;
+}
+
+static void free_spec_buffers(void)
+{
+	queue_free(&spec_queue);
+	queue_free(&row_queue);
+	free_arena();
+	g_free(acc);
+	acc = NULL;
+	g_free(spec_values);
+	spec_values = NULL;
+
+	if (fftin[0])
+	{
+#ifdef USE_FFTW3
+		FFTW(free)(fftin[0]);
+#else
+		g_free(fftin[0]);
+#endif
+		for (int i = 0;i < 3;i++) fftin[i] = NULL;
+	}
+
+#ifdef USE_FFTW3
+	FFTW(free)(job_in);
+	FFTW(free)(job_re);
+	FFTW(free)(job_im);
+	job_re = NULL;
+	job_im = NULL;
+#else
+	g_free(job_in);
+#endif
+	job_in = NULL;
+
+#ifdef USE_FFTW3
+	FFTW(free)(specre);
+	FFTW(free)(specim);
+	specre = NULL;
+	specim = NULL;
+#endif
+
+	g_free(goertzel_coef);
+	goertzel_coef = NULL;
+	g_free(window);
+	window = NULL;
+	g_free(wscale);
+	wscale = NULL;
+
+	free_plans();
+}
+
+static void alloc_spec_buffers(void)
+{
+	free_spec_buffers();
+
+	// the ring (3 planes or one plane of triples), its times and tags and
+	// the slots of the stage queues, each plane and slot cache line aligned
+	size_t plane = align_up((size_t)sample_size * ring.len, ARENA_ALIGN);
+	size_t ring_bytes = 3 * plane;
+	size_t tag_bytes = align_up(sizeof(guint64) * ring.nsegs, ARENA_ALIGN);
+	spec_stride = align_up(sizeof(fftw_real) * nbins, ARENA_ALIGN) / sizeof(fftw_real);
+	arena = alloc_arena(arena_bytes(ring.nsegs));
+
+	ring.data = arena;
+	ring.times = (gint64*)((char*)arena + ring_bytes);
+	ring.tags = (guint64*)((char*)arena + ring_bytes + tag_bytes);
+	ring.axis_stride = interleaved ? 1 : plane / sample_size;
+	ring.step = interleaved ? 3 : 1;
+	char* slots = (char*)arena + ring_bytes + 2 * tag_bytes;
+	if (!queue_init(&spec_queue, slots, SPEC_QUEUE_LEN, slot_bytes()) ||
+		!queue_init(&row_queue, slots + SPEC_QUEUE_LEN * slot_bytes(), ROW_QUEUE_LEN, slot_bytes()))
+	{
+		printf("no eventfd for the stage queues, falling back to polling\n");
+	}
+	acc = g_new0(double, 3 * nbins);
+	aind = 0;
+	spec_values = g_new(float, nbins);
+
+	// no slot holds a segment yet
+	for (int s = 0;s < ring.nsegs;s++) ring.tags[s] = TAG_BUSY;
+
+	ring.head = 0;
+	ring.tail = 0;
+	ring.fill = 0;
+
+	// all axes of a block in one (for FFTW3 aligned) piece of memory, so that
+	// the batched transform can run over it
+#ifdef USE_FFTW3
+	fftin[0] = FFTW(malloc)(sizeof(fftw_real) * 3 * fft_size);
+#else
+	fftin[0] = g_new(fftw_real, 3 * fft_size);
+#endif
+	for (int i = 1;i < 3;i++)
+	{
+		fftin[i] = fftin[0] + i * fft_size;
+	}
+
+	// every job of the pool gets its own aligned input (and FFTW3 output)
+	if (nthreads > 1)
+	{
+		job_stride = align_up(sizeof(fftw_real) * fft_size, ARENA_ALIGN) / sizeof(fftw_real);
+#ifdef USE_FFTW3
+		job_cstride = align_up(sizeof(fftw_real) * (fft_size / 2 + 1), ARENA_ALIGN) / sizeof(fftw_real);
+		job_in = FFTW(malloc)(sizeof(fftw_real) * 3 * MAX_BATCH_BLOCKS * job_stride);
+		job_re = FFTW(malloc)(sizeof(fftw_real) * 3 * MAX_BATCH_BLOCKS * job_cstride);
+		job_im = FFTW(malloc)(sizeof(fftw_real) * 3 * MAX_BATCH_BLOCKS * job_cstride);
+#else
+		job_in = g_new(fftw_real, 3 * MAX_BATCH_BLOCKS * job_stride);
+#endif
+	}
+
+	make_window();
+
+	// the integer samples are scaled together with the window
+	if (sample_format != SAMPLE_REAL)
+	{
+		wscale = g_new(fftw_real, fft_size);
+		for (int n = 0;n < fft_size;n++)
+		{
+			wscale[n] = (window ? window[n] : 1.0) * lsb;
+		}
+	}
+
+	if (spec_engine == SPEC_ENGINE_GOERTZEL)
+	{
+		goertzel_coef = g_new0(fftw_real, nbins);
+		for (int k = 0;k < nbins;k++)
+		{
+			goertzel_coef[k] = 2.0 * cos(2.0 * M_PI * k / fft_size);
+		}
+		return;
+	}
+
+	// plan the transforms here, so that process() never has to
+#ifdef USE_FFTW3
+	specre = FFTW(malloc)(sizeof(fftw_real) * 3 * (fft_size / 2 + 1));
+	specim = FFTW(malloc)(sizeof(fftw_real) * 3 * (fft_size / 2 + 1));
+	get_plan(fft_size, SPEC_FORWARD, 3);
+	// the pool transforms one axis per job
+	if (nthreads > 1) get_plan(fft_size, SPEC_FORWARD, 1);
+#else
+	get_plan(fft_size, SPEC_FORWARD, 1);
+#endif
+
+	// keep what was measured, even if we never get to a clean exit
+	save_wisdom();
+}
+
+static int track_bin(int t)
+{
+	return (int)lround(g_ascii_strtod(track_freqs[t], NULL) * fft_size / samplerate);
+}
+
+static void free_trackers(void)
+{
+	for (int i = 0;i < 3;i++)
+	{
+		sdft_free(tracker[i]);
+		tracker[i] = NULL;
+	}
+	g_free(track_time);
+	g_free(track_values);
+	g_free(track_gap);
+	track_time = NULL;
+	track_values = NULL;
+	track_gap = NULL;
+}
+
+// one sliding DFT over fft_size samples per axis for the --track frequencies
+static void alloc_trackers(void)
+{
+	free_trackers();
+
+	ntracks = track_freqs ? g_strv_length(track_freqs) : 0;
+	if (ntracks == 0) return;
+
+	int bins[ntracks];
+	for (int t = 0;t < ntracks;t++) bins[t] = track_bin(t);
+	for (int i = 0;i < 3;i++)
+	{
+		tracker[i] = sdft_new(fft_size, bins, ntracks);
+	}
+
+	track_time = g_new(gint64, TRACK_QUEUE_LEN);
+	track_values = g_new(fftw_real, TRACK_QUEUE_LEN * 3 * ntracks);
+	track_gap = g_new(int, TRACK_QUEUE_LEN);
+	track_countdown = MAX(1, track_interval_ms * samplerate / 1000);
+}
+
+// Writes the segments the producer has queued in spill.out to the file. A
+// segment that cannot be written is lost; the next one takes its place.
+static gpointer spill_stage(gpointer data)
+{
+	for (;;)
+	{
+		void* rec = queue_front(&spill.out);
+		if (!rec)
+		{
+			if (__atomic_load_n(&spill.stop, __ATOMIC_ACQUIRE)) break;
+			queue_wait_data(&spill.out, WAKEUP_TIMEOUT_MS);
+			continue;
+		}
+
+		off_t ofs = (off_t)(spill.head - spill.base) * spill.rec_size;
+		if (pwrite(spill.fd, rec, spill.rec_size, ofs) == (ssize_t)spill.rec_size)
+		{
+			__atomic_store_n(&spill.head, spill.head + 1, __ATOMIC_RELEASE);
+			queue_signal_fd(wakeup_fd);
+		}
+		else
+		{
+			__atomic_store_n(&spill.lost_segs, spill.lost_segs + 1, __ATOMIC_RELAXED);
+		}
+		// after head: an empty queue tells the producer that head is final
+		queue_pop(&spill.out);
+	}
+	return NULL;
+}
+
+// the overflow queue is a deleted file in the output directory, it goes
+// away with the process
+static void open_spill(void)
+{
+	char* name = g_strdup_printf("%s/.spill-XXXXXX", output_dir);
+
+	spill.rec_size = (size_t)3 * hop * sample_size + sizeof(gint64);
+	spill.rbuf = g_malloc(spill.rec_size);
+	spill.fd = mkstemp(name);
+	if (spill.fd < 0)
+	{
+		printf("ERROR: could not create a spill file in %s, new samples are dropped on overflow\n",
+			output_dir);
+	}
+	else
+	{
+		unlink(name);
+	}
+	g_free(name);
+	if (spill.fd < 0) return;
+
+	// before enter_realtime(): the thread keeps the default scheduling
+	size_t slot_size = align_up(spill.rec_size, ARENA_ALIGN);
+	spill.slots = g_malloc(SPILL_QUEUE_LEN * slot_size);
+	if (!queue_init(&spill.out, spill.slots, SPILL_QUEUE_LEN, slot_size))
+	{
+		printf("no eventfd for the spill queue, falling back to polling\n");
+	}
+	spill.stop = 0;
+	spill.thread = g_thread_new("spill", spill_stage, NULL);
+}
+
+static void close_spill(void)
+{
+	if (spill.thread)
+	{
+		// the callback is gone, the queued segments still go to the file
+		__atomic_store_n(&spill.stop, 1, __ATOMIC_RELEASE);
+		queue_kick(&spill.out);
+		g_thread_join(spill.thread);
+		spill.thread = NULL;
+	}
+
+	guint64 left = spill.head - spill.tail;
+	if (left)
+	{
+		printf("%llu segments in the spill file were not processed\n", (unsigned long long)left);
+	}
+
+	if (spill.fd >= 0) close(spill.fd);
+	spill.fd = -1;
+	queue_free(&spill.out);
+	g_free(spill.slots);
+	g_free(spill.rbuf);
+	spill.slots = NULL;
+	spill.buf = NULL;
+	spill.rbuf = NULL;
+}
+
+// Everything the callback and process() touch is allocated by now: fault it
+// in and lock it, so that no page has to come from disk or the allocator
+// later. The processing thread (this one) gets its scheduling here, the
+// callback thread belongs to the Phidget library and does it on its first
+// call.
+static void enter_realtime(void)
+{
+	rt_prefault(arena, arena_size);
+	rt_prefault(fftin[0], sizeof(fftw_real) * 3 * fft_size);
+	rt_prefault(job_in, sizeof(fftw_real) * 3 * MAX_BATCH_BLOCKS * job_stride);
+	if (spill.slots) rt_prefault(spill.slots, SPILL_QUEUE_LEN * align_up(spill.rec_size, ARENA_ALIGN));
+
+	gboolean ok = rt_lock_memory();
+	ok = rt_setup_thread("processing", rt_policy, rt_priority - 1, process_cpus) && ok;
+	rt_thread_ready = TRUE;
+
+	if (ok)
+	{
+		printf("memory locked, processing under SCHED_%s priority %i\n",
+			(rt_policy == SCHED_FIFO) ? "FIFO" : "RR", rt_priority - 1);
+	}
+	else
+	{
+		printf("running without the missing realtime settings, samples may get lost\n");
+	}
+}
+
+// describes the rows in the header of the spectrum archive
+static void init_archive(void)
+{
+	static const char* units[3] = {"mg", "mg^2", "dB re 1 mg"};
+
+	memset(&spec_info, 0, sizeof(spec_info));
+	spec_info.encoding = encoding;
+	spec_info.samplerate = samplerate;
+	spec_info.fft_size = fft_size;
+	spec_info.hop = hop;
+	spec_info.first_bin = 0;
+	spec_info.nbins = nbins;
+	spec_info.axes = 3;
+	spec_info.interval_blocks = navg;
+	spec_info.aggregation = max_instead_of_avg ? SPECFILE_MAXIMUM : SPECFILE_AVERAGE;
+	spec_info.kind = mag_kind;
+	g_strlcpy(spec_info.units, units[mag_kind], sizeof(spec_info.units));
+	g_strlcpy(spec_info.window, window_name, sizeof(spec_info.window));
+
+	// log16: the step in log2 units (dB are 20 log10 of an amplitude, 10 log10
+	// of a power). The codes are centered on 1 mg (mg^2) while they span less
+	// than the normal floats (2^-126 to 2^128), else code 1 is FLT_MIN and
+	// only the codes above FLT_MAX are left unused.
+	double step = log_step_db / ((mag_kind == MAG_POWER) ? 10.0 : 20.0) * log2(10.0);
+	gboolean centered = 65534 * step < log2(FLT_MAX) - log2(FLT_MIN);
+	spec_info.log_scale = step;
+	spec_info.log_offset = centered ? -32768.0 * step : log2(FLT_MIN) - step;
+	specfile_layout(&spec_info);
+
+	if (encoding == SPECFILE_LOG16)
+	{
+		printf("log16 values: %g dB steps from %g to %g %s\n", log_step_db, exp2(spec_info.log_offset + step),
+			MIN(exp2(spec_info.log_offset + 65535 * step), FLT_MAX), spec_info.units);
+	}
+}
+
+static void open_output(void)
+{
+	printf("vector kernels: %s\n", kernels_init());
+	load_wisdom();
+	alloc_spec_buffers();
+	alloc_trackers();
+	if (output_format == OUTPUT_SPEC) init_archive();
+	if (overflow_policy == OVERFLOW_SPILL) open_spill();
+
+	if (nthreads > 1)
+	{
+		pool = g_thread_pool_new(run_job, NULL, nthreads, TRUE, NULL);
+		printf("transforms on %i threads\n", nthreads);
+	}
+
+	if (realtime) enter_realtime();
+}
+
+static gboolean does_file_exist(char* name)
+{
+	gboolean exist = FALSE;
+	FILE* ofp = fopen(name, "r");
+	if (ofp != NULL)
+	{
+		exist = TRUE;
+		fclose(ofp);
+	}
+	return exist;
+}
+
+// appends printf output to t
+static void text_printf(text_buf* t, const char* format, ...)
+{
+	va_list args;
+
+	for (;;)
+	{
+		va_start(args, format);
+		int n = vsnprintf(t->p + t->len, t->size - t->len, format, args);
+		va_end(args);
+		if (n < 0) return;
+		if (t->len + n < t->size)
+		{
+			t->len += n;
+			return;
+		}
+		t->size = MAX(2 * t->size, t->len + n + 1);
+		t->p = g_realloc(t->p, t->size);
+	}
+}
+
+// Makes room for n more chars at the end of t and returns where they go.
+// The rows are formatted in place, the caller sets t->len afterwards.
+static char* text_reserve(text_buf* t, size_t n)
+{
+	if (t->len + n > t->size)
+	{
+		t->size = MAX(2 * t->size, t->len + n);
+		t->p = g_realloc(t->p, t->size);
+	}
+	return t->p + t->len;
+}
+
+static void csv_header(text_buf* t)
+{
+	text_printf(t, "timestamp");
+	for (int i = 0;i < nbins;i++)
+	{
+		text_printf(t, ",%g Hz", (double)i * samplerate / fft_size);
+	}
+	text_printf(t, ",lost\n");
+}
+
+static void track_header(text_buf* t)
+{
+	text_printf(t, "timestamp");
+	for (int k = 0;k < ntracks;k++)
+	{
+		double f = (double)track_bin(k) * samplerate / fft_size;
+		text_printf(t, ",x %g Hz,y %g Hz,z %g Hz", f, f, f);
+	}
+	text_printf(t, ",lost\n");
+}
+
+// Writes the pending header and rows of f in one writev() and syncs the
+// file if the sync policy asks for it (or force). On an error the rows
+// are dropped, the error is reported once until a write succeeds again.
+// What got through of a failed batch is cut off again, so that the file
+// ends with a complete row (record of an archive).
+static void flush_file(output_file* f, gboolean force)
+{
+	if (f->fd < 0) return;
+
+	struct iovec iov[2] = {
+		{f->head_pending ? f->header.p : NULL, f->head_pending ? f->header.len : 0},
+		{f->rows.p, f->rows.len}
+	};
+	int first = f->head_pending ? 0 : 1;
+	size_t total = iov[0].iov_len + iov[1].iov_len;
+	size_t left = total;
+
+	while (left > 0)
+	{
+		ssize_t n = writev(f->fd, iov + first, 2 - first);
+		if (n < 0)
+		{
+			if (errno == EINTR) continue;
+			if (!f->failed) printf("ERROR: could not write output file: %s\n", strerror(errno));
+			f->failed = TRUE;
+			break;
+		}
+		left -= n;
+		for (;(first < 2) && (n >= (ssize_t)iov[first].iov_len);first++) n -= iov[first].iov_len;
+		if (first < 2)
+		{
+			iov[first].iov_base = (char*)iov[first].iov_base + n;
+			iov[first].iov_len -= n;
+		}
+	}
+	if (left == 0)
+	{
+		f->failed = FALSE;
+		f->end += total;
+		if (total) f->dirty = TRUE;
+	}
+	else if ((left < total) && (ftruncate(f->fd, f->end) < 0))
+	{
+		printf("ERROR: could not remove a partly written batch: %s\n", strerror(errno));
+	}
+
+	// the header goes first until it is written
+	f->head_pending = f->head_pending && (left != 0);
+	f->rows.len = 0;
+
+	if (f->dirty && ((sync_policy != SYNC_NEVER) || force))
+	{
+		gint64 now = g_get_monotonic_time();
+		if (force ||
+			((sync_policy == SYNC_ROWS) && (f->unsynced_rows >= sync_every)) ||
+			((sync_policy == SYNC_SECONDS) && (now - f->synced >= (gint64)sync_every * G_USEC_PER_SEC)))
+		{
+			fdatasync(f->fd);
+			f->dirty = FALSE;
+			f->unsynced_rows = 0;
+			f->synced = now;
+		}
+	}
+}
+
+// Returns the file of the day of ti named YYYY-MM-DD_<tail> to append rows
+// to f->rows. It is only reopened when the day changes, the last rows of a
+// day are synced unless --sync is never. A new file gets the header, an
+// existing one is checked by resume (if not NULL). One that cannot be
+// continued is left alone, the rows go to YYYY-MM-DD_<name>.1.<ext>, .2, ...
+// instead.
+static output_file* day_file(output_file* f, const struct tm* ti, const char* tail,
+	void (*header)(text_buf*), gboolean (*resume)(output_file*, off_t))
+{
+	int day = (ti->tm_year + 1900) * 10000 + (ti->tm_mon + 1) * 100 + ti->tm_mday;
+	if ((f->fd >= 0) && (f->day == day)) return f;
+	if (f->refused_day == day) return NULL;
+
+	if (f->fd >= 0)
+	{
+		flush_file(f, sync_policy != SYNC_NEVER);
+		close(f->fd);
+	}
+	f->day = day;
+	if (f->header.len == 0) header(&f->header);
+
+	const char* ext = strrchr(tail, '.');
+	int name_len = ext ? (int)(ext - tail) : (int)strlen(tail);
+	char* filename = NULL;
+	off_t size = 0;
+	for (int n = 0;;n++)
+	{
+		g_free(filename);
+		if (n == 0)
+		{
+			filename = g_strdup_printf("%s/%4.4i-%2.2i-%2.2i_%s", output_dir,
+				ti->tm_year + 1900, ti->tm_mon + 1, ti->tm_mday, tail);
+		}
+		else
+		{
+			filename = g_strdup_printf("%s/%4.4i-%2.2i-%2.2i_%.*s.%i%s", output_dir,
+				ti->tm_year + 1900, ti->tm_mon + 1, ti->tm_mday, name_len, tail, n, ext ? ext : "");
+		}
+
+		f->fd = open(filename, (resume ? O_RDWR : O_WRONLY) | O_CREAT | O_APPEND, 0644);
+		if (f->fd < 0)
+		{
+			printf("ERROR: could not open/create output file: %s\n", filename);
+			g_free(filename);
+			return NULL;
+		}
+
+		size = lseek(f->fd, 0, SEEK_END);
+		if ((size == 0) || !resume || resume(f, size)) break;
+
+		close(f->fd);
+		f->fd = -1;
+		if (n == MAX_DAY_FILES)
+		{
+			printf("ERROR: cannot append to %s, no more files for this day\n", filename);
+			f->refused_day = day;
+			g_free(filename);
+			return NULL;
+		}
+		printf("cannot append to %s (different settings), trying the next file\n", filename);
+	}
+	f->head_pending = (size == 0);
+	g_free(filename);
+	f->end = lseek(f->fd, 0, SEEK_END); // resume may have cut the file
+	f->synced = g_get_monotonic_time();
+
+	return f;
+}
+
+// writes the rows collected by the write stage, see write_stage()
+static void flush_output_files(void)
+{
+	for (int i = 0;i < 3;i++) flush_file(&csv_files[i], FALSE);
+	flush_file(&spec_out, FALSE);
+	flush_file(&track_file, FALSE);
+}
+
+static void close_file(output_file* f)
+{
+	if (f->fd >= 0)
+	{
+		flush_file(f, sync_policy != SYNC_NEVER);
+		close(f->fd);
+	}
+	f->fd = -1;
+	g_free(f->rows.p);
+	g_free(f->header.p);
+	memset(&f->rows, 0, sizeof(text_buf));
+	memset(&f->header, 0, sizeof(text_buf));
+}
+
+static void close_output_files(void)
+{
+	for (int i = 0;i < 3;i++) close_file(&csv_files[i]);
+	close_file(&spec_out);
+	close_file(&track_file);
+}
+
+// Converts a spectrum value to mg. The magnitude of a sine with amplitude a
+// is a * window_gain / 2 (a * N / 2 without window), and the values are in g.
+static double scale_value(double v)
+{
+	double f = window_gain / 1000.0;
+
+	if (mag_kind == MAG_POWER) return v / (f * f);
+	if (mag_kind == MAG_DB) return v - 20.0 * log10(f);
+	return v / f;
+}
+
+// Local time of the current day: localtime() only runs when a timestamp
+// leaves the cached window. On days with a change of the UTC offset the
+// window is one hour instead.
+typedef struct
+{
+	time_t start, end;
+	struct tm tm; // at start
+} day_cache;
+
+static day_cache row_day = {0, 0};
+static day_cache track_day = {0, 0};
+
+static void local_time(day_cache* c, time_t t, struct tm* ti)
+{
+	if ((t < c->start) || (t >= c->end))
+	{
+		struct tm tm, last;
+
+		localtime_r(&t, &tm);
+		c->start = t - tm.tm_sec - 60 * (tm.tm_min + 60 * tm.tm_hour);
+		c->end = c->start + 24 * 3600;
+		time_t e = c->end - 1;
+		localtime_r(&c->start, &c->tm);
+		localtime_r(&e, &last);
+		if ((c->tm.tm_gmtoff != tm.tm_gmtoff) || (last.tm_gmtoff != tm.tm_gmtoff))
+		{
+			c->start = t - tm.tm_sec - 60 * tm.tm_min;
+			c->end = c->start + 3600;
+			localtime_r(&c->start, &c->tm);
+		}
+	}
+
+	int d = (int)(t - c->start);
+	*ti = c->tm;
+	ti->tm_hour += d / 3600;
+	ti->tm_min += d / 60 % 60;
+	ti->tm_sec += d % 60;
+}
+
+// writes the values of axis dim of a row_queue slot, stamped with the device
+// time of its end; its lost column is the number of samples lost during the
+// row, 0 means no gap
+static gboolean output_csv(int dim, void* row)
+{
+	static const char* tails[3] = {"x_" OUTPUT_MARKER ".csv", "y_" OUTPUT_MARKER ".csv", "z_" OUTPUT_MARKER ".csv"};
+	struct tm tm;
+	struct tm* ti = &tm;
+
+	local_time(&row_day, ((slot_info*)row)->time / G_USEC_PER_SEC, ti);
+
+	output_file* f = day_file(&csv_files[dim], ti, tails[dim], csv_header, NULL);
+	if (f == NULL) return FALSE;
+
+	char* p = text_reserve(&f->rows, ROW_TIME_MAX + (nbins + 1) * (FORMAT_FIXED_MAX + 1) + 1);
+	char* start = p;
+
+	p += snprintf(p, ROW_TIME_MAX, "%4.4i-%2.2i-%2.2i %2.2i:%2.2i:%2.2i",
+		ti->tm_year + 1900, ti->tm_mon + 1, ti->tm_mday,
+		ti->tm_hour, ti->tm_min, ti->tm_sec);
+
+	const fftw_real* v = slot_values(row, dim);
+	for (int k = 0;k < nbins;k++)
+	{
+		*p++ = ',';
+		p += format_fixed(p, v[k], decimals);
+	}
+
+	*p++ = ',';
+	p += format_uint(p, ((slot_info*)row)->lost);
+	*p++ = '\n';
+	f->rows.len += p - start;
+	f->unsynced_rows++;
+
+	return TRUE;
+}
+
+static void spec_header(text_buf* t)
+{
+	specfile_put_header(&spec_info, (unsigned char*)text_reserve(t, spec_info.header_size));
+	t->len += spec_info.header_size;
+}
+
+// An archive of the day is only continued with the same header. A record
+// cut short (the program was killed while writing it) is removed.
+static gboolean spec_resume(output_file* f, off_t size)
+{
+	unsigned char* head = g_malloc(spec_info.header_size);
+	gboolean same = (pread(f->fd, head, spec_info.header_size, 0) == (ssize_t)spec_info.header_size) &&
+		!memcmp(head, f->header.p, spec_info.header_size);
+	g_free(head);
+	if (!same) return FALSE;
+
+	off_t partial = (size - spec_info.header_size) % spec_info.record_size;
+	return (partial == 0) || (ftruncate(f->fd, size - partial) == 0);
+}
+
+// writes a row_queue slot as a record of the spectrum archive of the day,
+// see specfile.h
+static gboolean output_spec(void* row)
+{
+	struct tm tm;
+	slot_info* info = row;
+
+	local_time(&row_day, info->time / G_USEC_PER_SEC, &tm);
+
+	output_file* f = day_file(&spec_out, &tm, OUTPUT_MARKER ".spec", spec_header, spec_resume);
+	if (f == NULL) return FALSE;
+
+	unsigned char* rec = (unsigned char*)text_reserve(&f->rows, spec_info.record_size);
+	specfile_put_record_head(rec, info->time, info->lost);
+	for (int i = 0;i < 3;i++)
+	{
+		const fftw_real* v = slot_values(row, i);
+		for (int k = 0;k < nbins;k++) spec_values[k] = v[k];
+		specfile_put_values(&spec_info, rec, i, spec_values);
+	}
+	f->rows.len += spec_info.record_size;
+	f->unsynced_rows++;
+
+	return TRUE;
+}
+
+// Writes the rows of tracked bins that the callback has queued. Called from
+// the write stage only, the callback only writes track_head. The lost column
+// is the number of rows the callback dropped (queue full) before the row.
+static gboolean output_tracks(gboolean all)
+{
+	int head = __atomic_load_n(&track_head, __ATOMIC_ACQUIRE);
+	int rows = head - track_tail;
+
+	if ((rows == 0) || ((rows < TRACK_FLUSH_ROWS) && !all)) return TRUE;
+
+	struct tm tm;
+	struct tm* ti = &tm;
+
+	while (track_tail != head)
+	{
+		int r = track_tail % TRACK_QUEUE_LEN;
+		local_time(&track_day, track_time[r] / G_USEC_PER_SEC, ti);
+		output_file* f = day_file(&track_file, ti, "track_" OUTPUT_MARKER ".csv", track_header, NULL);
+		if (f == NULL) return FALSE;
+
+		char* p = text_reserve(&f->rows, ROW_TIME_MAX + (3 * ntracks + 1) * (FORMAT_FIXED_MAX + 1) + 1);
+		char* start = p;
+
+		p += snprintf(p, ROW_TIME_MAX, "%4.4i-%2.2i-%2.2i %2.2i:%2.2i:%2.2i.%3.3i",
+			ti->tm_year + 1900, ti->tm_mon + 1, ti->tm_mday,
+			ti->tm_hour, ti->tm_min, ti->tm_sec,
+			(int)(track_time[r] % G_USEC_PER_SEC / 1000));
+
+		fftw_real* v = track_values + r * 3 * ntracks;
+		for (int t = 0;t < 3 * ntracks;t++)
+		{
+			*p++ = ',';
+			p += format_fixed(p, v[t] / (fft_size / 1000.0), decimals);// unit is mg
+		}
+		*p++ = ',';
+		p += format_uint(p, track_gap[r]);
+		*p++ = '\n';
+		f->rows.len += p - start;
+		f->unsynced_rows++;
+
+		// hand the row back to the callback
+		__atomic_store_n(&track_tail, track_tail + 1, __ATOMIC_RELEASE);
+	}
+
+	return TRUE;
+}
+
+// element index of sample pos of axis i in ring.data
+static inline int ring_index(int i, int pos)
+{
+	return i * ring.axis_stride + pos * ring.step;
+}
+
+// copies n samples from position pos of the plane of axis i to dst,
+// converts them to fftw_real and applies the window from position wpos on
+static void load_samples(int i, int pos, int wpos, fftw_real* dst, int n)
+{
+	int idx = ring_index(i, pos);
+
+	if (sample_format == SAMPLE_INT32)
+	{
+		convert_i32((gint32*)ring.data + idx, wscale + wpos, dst, n);
+	}
+	else if (sample_format == SAMPLE_INT16)
+	{
+		convert_i16((gint16*)ring.data + idx, wscale + wpos, dst, n);
+	}
+	else if (window)
+	{
+		apply_window((fftw_real*)ring.data + idx, window + wpos, dst, n);
+	}
+	else
+	{
+		memcpy(dst, (fftw_real*)ring.data + idx, sizeof(fftw_real) * n);
+	}
+}
+
+// interleaved layout: the same for all axes in one pass over n triples
+static void load_triples(int pos, int wpos, fftw_real** in, int off, int n)
+{
+	const fftw_real* w = (sample_format == SAMPLE_REAL) ? window : wscale;
+	int idx = ring_index(0, pos);
+
+	for (int s = 0;s < n;s++, idx += 3)
+	{
+		double g = w ? w[wpos + s] : 1.0;
+		for (int i = 0;i < 3;i++)
+		{
+			double v;
+			if (sample_format == SAMPLE_INT32)
+			{
+				v = ((gint32*)ring.data)[idx + i];
+			}
+			else if (sample_format == SAMPLE_INT16)
+			{
+				v = ((gint16*)ring.data)[idx + i];
+			}
+			else
+			{
+				v = ((fftw_real*)ring.data)[idx + i];
+			}
+			in[i][off + s] = v * g;
+		}
+	}
+}
+
+// copies the fft_size samples that end with segment seg into in[] and
+// applies the window on the way
+static void load_block(int seg, fftw_real** in)
+{
+	int start = (seg + 1) * hop - fft_size;
+	if (start < 0) start += ring.len;
+
+	// the block may wrap around the end of the ring
+	int n1 = MIN(fft_size, ring.len - start);
+	if (interleaved)
+	{
+		load_triples(start, 0, in, 0, n1);
+		load_triples(0, n1, in, n1, fft_size - n1);
+		return;
+	}
+	for (int i = 0;i < 3;i++)
+	{
+		load_samples(i, start, 0, in[i], n1);
+		load_samples(i, 0, n1, in[i] + n1, fft_size - n1);
+	}
+}
+
+// copies n samples of the planar segment record src (see spill_queue) into
+// the ring from position pos on
+static void ring_put(const char* src, int pos, int n)
+{
+	for (int i = 0;i < 3;i++, src += (size_t)sample_size * n)
+	{
+		char* dst = (char*)ring.data + (size_t)sample_size * ring_index(i, pos);
+		if (!interleaved)
+		{
+			memcpy(dst, src, (size_t)sample_size * n);
+			continue;
+		}
+		for (int s = 0;s < n;s++)
+		{
+			memcpy(dst + (size_t)sample_size * 3 * s, src + (size_t)sample_size * s, sample_size);
+		}
+	}
+}
+
+// OVERFLOW_SPILL: moves queued segments from the file into the free slots
+// of the ring. The producer leaves ring.head to us as long as the queue is
+// not empty.
+static void spill_refill(void)
+{
+	guint64 head = __atomic_load_n(&spill.head, __ATOMIC_ACQUIRE);
+
+	while ((spill.tail < head) && (ring.head - ring.tail < ring.nsegs - ring.history))
+	{
+		off_t ofs = (off_t)(spill.tail - spill.base) * spill.rec_size;
+		if (pread(spill.fd, spill.rbuf, spill.rec_size, ofs) != (ssize_t)spill.rec_size)
+		{
+			printf("ERROR: could not read back the spill file, segment lost\n");
+			consumer_lost += hop;
+			consumer_lost_segs++;
+		}
+		else
+		{
+			int slot = ring.head % ring.nsegs;
+			ring_put(spill.rbuf, slot * hop, hop);
+			memcpy(&ring.times[slot], (char*)spill.rbuf + spill.rec_size - sizeof(gint64), sizeof(gint64));
+			__atomic_store_n(&ring.head, ring.head + 1, __ATOMIC_RELEASE);
+		}
+		// the last one hands the ring back to the producer
+		__atomic_store_n(&spill.tail, spill.tail + 1, __ATOMIC_RELEASE);
+	}
+}
+
+// OVERFLOW_DROP_OLDEST: jumps over the segments whose blocks the producer
+// has overwritten already (or will while we are at them)
+static void skip_overwritten(guint64 head)
+{
+	// slot head % nsegs may be in work, the block of segment q needs the
+	// slots of q - history ... q
+	if (head + ring.history + 1 <= ring.nsegs) return;
+
+	guint64 oldest = head + ring.history + 1 - ring.nsegs;
+	if (ring.tail < oldest)
+	{
+		consumer_lost += (oldest - ring.tail) * hop;
+		consumer_lost_segs += oldest - ring.tail;
+		__atomic_store_n(&ring.tail, oldest, __ATOMIC_RELEASE);
+	}
+}
+
+// O(1): the slot of the oldest segment that is complete and not processed
+static gboolean ring_next(int* seg)
+{
+	if (overflow_policy == OVERFLOW_SPILL) spill_refill();
+
+	guint64 head = __atomic_load_n(&ring.head, __ATOMIC_ACQUIRE);
+	if (overflow_policy == OVERFLOW_DROP_OLDEST) skip_overwritten(head);
+	if (ring.tail == head) return FALSE;
+	ring_high = MAX(ring_high, (int)(head - ring.tail));
+
+	*seg = ring.tail % ring.nsegs;
+	return TRUE;
+}
+
+// hands the oldest segment back to the producer
+static void ring_release(void)
+{
+	__atomic_store_n(&ring.tail, ring.tail + 1, __ATOMIC_RELEASE);
+}
+
+// OVERFLOW_DROP_OLDEST: TRUE if the slots of the block of segment q hold
+// the segments q - history ... q
+static gboolean block_tags_ok(guint64 q)
+{
+	for (guint64 j = q - ring.history;j <= q;j++)
+	{
+		if (__atomic_load_n(&ring.tags[j % ring.nsegs], __ATOMIC_ACQUIRE) != j) return FALSE;
 	}
-	return exist;
+	return TRUE;
 }
 
-static gboolean csv_prepare(char* name)
+// Loads the block of segment q into in[] and returns the wall clock time
+// of its end. A block the producer has overwritten meanwhile is zeroed and
+// counted as lost.
+static gint64 fetch_block(guint64 q, fftw_real** in)
 {
-	// check if the output file already exist
-	char* open_mode = "w";
-	if (does_file_exist(name)) open_mode = "a";
-
-	// create output file
-	FILE* ofp = fopen(name, open_mode);
+	int seg = q % ring.nsegs;
+	gint64 t = 0;
+	gboolean ok = TRUE;
 
-	if (!ofp)
+	if (overflow_policy != OVERFLOW_DROP_OLDEST)
 	{
-		printf("ERROR: could not open/create output file: %s\n", name);
-		return FALSE;
+		t = ring.times[seg];
+		load_block(seg, in);
 	}
-
-	// create header
-	if (strcmp(open_mode, "a"))
+	else
 	{
-		fprintf(ofp, "timestamp");
-		for (int i = 0;i < maxfreq + 1;i++)
+		// the time of the segment is read like the samples, between the
+		// tag checks (atomically, the producer may be writing it)
+		ok = block_tags_ok(q);
+		if (ok)
 		{
-			fprintf(ofp, ",%i Hz", i);
+			t = __atomic_load_n(&ring.times[seg], __ATOMIC_RELAXED);
+			load_block(seg, in);
+			__atomic_thread_fence(__ATOMIC_ACQUIRE);
+			ok = block_tags_ok(q);
 		}
-		fprintf(ofp, "\n");
 	}
 
-	fclose(ofp);
+	gint64 hop_us = (gint64)hop * G_USEC_PER_SEC / samplerate;
+	if (!ok)
+	{
+		for (int i = 0;i < 3;i++) memset(in[i], 0, sizeof(fftw_real) * fft_size);
+		consumer_lost += hop;
+		consumer_lost_segs++;
+		t = last_block_time; // the segment time may be torn too
+	}
+	last_block_time = t + hop_us;
+	return last_block_time;
+}
 
-	return TRUE;
+// samples lost by both sides since the last call
+static guint64 take_lost(void)
+{
+	guint64 total = __atomic_load_n(&ring.lost, __ATOMIC_RELAXED) + consumer_lost +
+		__atomic_load_n(&spill.lost_segs, __ATOMIC_RELAXED) * hop;
+	guint64 lost = total - lost_reported;
+	lost_reported = total;
+	return lost;
 }
 
-static gboolean output_csv(int dim)
+// Loads the pending blocks, as many as there are free slots in spec_queue,
+// and lets the pool transform their axes in parallel, so that a backlog is
+// worked off on all cores. The spectra go to consecutive slots, so the
+// aggregate stage gets them in the same order as without the pool.
+// Returns the number of blocks done.
+static int process_batch(int room, gint64* block_time)
 {
-	time_t rawtime;
-	struct tm * ti;
-	char dims[2] = {0};
+	guint64 head = __atomic_load_n(&ring.head, __ATOMIC_ACQUIRE);
+	int nblocks = (int)MIN(head - ring.tail, (guint64)MIN(MAX_BATCH_BLOCKS, room));
 
-	time(&rawtime);
-	ti = localtime(&rawtime);
+	g_mutex_lock(&jobs_lock);
+	jobs_left = 3 * nblocks;
+	g_mutex_unlock(&jobs_lock);
 
-	if (dim == 0)
-	{
-		dims[0] = 'x';
-	}
-	else if (dim == 1)
-	{
-		dims[0] = 'y';
-	}
-	else
+	for (int b = 0;b < nblocks;b++)
 	{
-		dims[0] = 'z';
+		fftw_real* in[3];
+		for (int i = 0;i < 3;i++)
+		{
+			in[i] = job_in + (size_t)(3 * b + i) * job_stride;
+		}
+		block_time[b] = fetch_block(ring.tail + b, in);
+
+		for (int i = 0;i < 3;i++)
+		{
+			jobs[3 * b + i].slot = 3 * b + i;
+			jobs[3 * b + i].out = slot_values(queue_back(&spec_queue, b), i);
+			g_thread_pool_push(pool, &jobs[3 * b + i], NULL);
+		}
 	}
 
-	char* filename = NULL;
-	filename = g_strdup_printf("%s/%4.4i-%2.2i-%2.2i_%s_%s.csv", output_dir,
-		ti->tm_year + 1900, ti->tm_mon + 1, ti->tm_mday, dims, OUTPUT_MARKER);
+	g_mutex_lock(&jobs_lock);
+	while (jobs_left > 0) g_cond_wait(&jobs_done, &jobs_lock);
+	g_mutex_unlock(&jobs_lock);
+
+	return nblocks;
+}
 
-	if (!csv_prepare(filename)) return FALSE;
+// transform stage
+static void process(void)
+{
+	int seg;
 
-	FILE* ofp = fopen(filename, "a");
-	if (ofp == NULL)
+	while (ring_next(&seg))
 	{
-		printf("ERROR: could not reopen output file: %s\n", filename);
-		return FALSE;
-	}
+		int nblocks = 1;
+		gint64 block_time[MAX_BATCH_BLOCKS];
 
-	g_free(filename);
+		// the first blocks have to wait until fft_size samples are there
+		if (ring.tail >= ring.history)
+		{
+			// with the aggregate stage behind, the samples wait in the ring
+			int room = queue_room(&spec_queue);
+			if (room == 0) break;
 
-	fprintf(ofp, "%4.4i-%2.2i-%2.2i %2.2i:%2.2i:%2.2i",
-		ti->tm_year + 1900, ti->tm_mon + 1, ti->tm_mday,
-		ti->tm_hour, ti->tm_min, ti->tm_sec);
+			if (pool)
+			{
+				nblocks = process_batch(room, block_time);
+			}
+			else
+			{
+				void* slot = queue_back(&spec_queue, 0);
+				fftw_real* spec[3] = {slot_values(slot, 0), slot_values(slot, 1), slot_values(slot, 2)};
+
+				block_time[0] = fetch_block(ring.tail, fftin);
+				calc_spectra(fftin, fft_size, spec);
+			}
 
-	for (int k = 0;k < maxfreq + 1;k++)
+			// losses go with the first block after them
+			for (int b = 0;b < nblocks;b++)
+			{
+				slot_info* info = queue_back(&spec_queue, b);
+				info->lost = (b == 0) ? take_lost() : 0;
+				info->time = block_time[b];
+			}
+			queue_push(&spec_queue, nblocks);
+		}
+
+		while (nblocks--) ring_release();
+	}
+}
+
+// adds the spectra of one block to acc
+static void accumulate(void* block)
+{
+	for (int i = 0;i < 3;i++)
 	{
-		float v = 0;
-		if (max_instead_of_avg)
+		const fftw_real* v = slot_values(block, i);
+		double* a = acc + i * nbins;
+
+		for (int k = 0;k < nbins;k++)
 		{
-			for (int j = 0;j < avg_int_in_sec;j++)
+			if (aind == 0)
 			{
-				if ((ampspec[dim][j][k] > v) || (j == 0))
-				{
-					v = ampspec[dim][j][k];
-				}
-				v /= (samplerate / 1000.0);
+				a[k] = v[k];
+			}
+			else if (max_instead_of_avg)
+			{
+				a[k] = MAX(a[k], v[k]);
+			}
+			else
+			{
+				a[k] += v[k];
 			}
 		}
-		else
+	}
+	acc_lost += ((slot_info*)block)->lost;
+	acc_time = ((slot_info*)block)->time;
+}
+
+// aggregate stage: averages (or takes the maximum of) navg block spectra
+// and hands the scaled row to the write stage
+static gpointer aggregate_stage(gpointer data)
+{
+	if (realtime) rt_setup_thread("aggregate", rt_policy, rt_priority - 1, process_cpus);
+
+	for (;;)
+	{
+		int stop = __atomic_load_n(&stages_stop, __ATOMIC_ACQUIRE);
+		void* block = queue_front(&spec_queue);
+		if (!block)
 		{
-			for (int j = 0;j < avg_int_in_sec;j++)
+			if (stop) break;
+			queue_wait_data(&spec_queue, WAKEUP_TIMEOUT_MS);
+			continue;
+		}
+
+		accumulate(block);
+		queue_pop(&spec_queue);
+		if (++aind < navg) continue;
+		aind = 0;
+
+		// a disk stall ends up here, the ring does not see it before
+		// row_queue and spec_queue are full
+		while (queue_room(&row_queue) == 0)
+		{
+			queue_wait_room(&row_queue, WAKEUP_TIMEOUT_MS);
+		}
+
+		// the row is stamped with the end of its last block; the block
+		// itself may be reused by the transform stage already
+		void* row = queue_back(&row_queue, 0);
+		((slot_info*)row)->lost = acc_lost;
+		((slot_info*)row)->time = acc_time;
+		acc_lost = 0;
+		for (int i = 0;i < 3;i++)
+		{
+			fftw_real* v = slot_values(row, i);
+			for (int k = 0;k < nbins;k++)
 			{
-				v += ampspec[dim][j][k];
+				double a = acc[i * nbins + k];
+				if (!max_instead_of_avg) a /= navg;
+				v[k] = scale_value(a);// unit is mg (mg^2, dB re 1 mg)
 			}
-			v /= (avg_int_in_sec * samplerate / 1000.0);// unit is mg
 		}
-
-		fprintf(ofp, ",%f", v);
+		queue_push(&row_queue, 1);
 	}
 
-	fprintf(ofp, "\n");
-	fclose(ofp);
-
-	return TRUE;
+	return NULL;
 }
 
-static void process(void)
+// Write stage: all file output but the wav file. The rows waiting in the
+// row queue, up to WRITE_BATCH_ROWS, are formatted and then written with one
+// writev() per file; the sync policy is applied after each batch and at
+// least every WAKEUP_TIMEOUT_MS.
+static gpointer write_stage(gpointer data)
 {
-	for (int k = 0;k < PIPELINE_LEN;k++)
+	// started by the transform stage, but the disk must not hold a CPU of
+	// the realtime threads
+	if (realtime) rt_reset_thread("write");
+
+	for (;;)
 	{
-		int ptr = ibptr + k + (PIPELINE_LEN / 10);
-		while ((ptr >= PIPELINE_LEN) && (ptr >= 0)) ptr = ptr - PIPELINE_LEN;
+		int stop = __atomic_load_n(&aggregate_done, __ATOMIC_ACQUIRE);
+		void* row;
+		int n = 0;
 
-		if (unproc[ptr])
+		if (ntracks) output_tracks(FALSE);
+		while ((n < WRITE_BATCH_ROWS) && (row = queue_front(&row_queue)))
 		{
-			if (ptr >= PIPELINE_LEN) ptr = 0;
-
-			for (int i = 0;i < 3;i++)
+			if (output_format == OUTPUT_SPEC)
 			{
-				calc_amplitude_spectrum(inbuf[ptr][i], samplerate, ampspec[i][aind]);
+				output_spec(row);
 			}
-			aind++;
-
-			if (aind == avg_int_in_sec)
+			else
 			{
-				aind = 0;
-
 				for (int i = 0;i < 3;i++)
 				{
-					output_csv(i);
+					output_csv(i, row);
 				}
 			}
-
-			unproc[ptr] = FALSE;
+			queue_pop(&row_queue);
+			n++;
 		}
+
+		flush_output_files();
+		if (n == WRITE_BATCH_ROWS) continue;
+		if (stop) break;
+		queue_wait_data(&row_queue, WAKEUP_TIMEOUT_MS);
 	}
+
+	if (ntracks) output_tracks(TRUE);
+	close_output_files();
+	return NULL;
+}
+
+static void report_queues(void)
+{
+	guint64 head = __atomic_load_n(&ring.head, __ATOMIC_ACQUIRE);
+
+	printf("queue depth (max): ring %i/%i (%i), spectra %i/%i (%i), rows %i/%i (%i)\n",
+		(int)(head - ring.tail), ring.nsegs - ring.history, ring_high,
+		queue_depth(&spec_queue), SPEC_QUEUE_LEN, spec_queue.high,
+		queue_depth(&row_queue), ROW_QUEUE_LEN, row_queue.high);
+}
+
+static void start_stages(void)
+{
+	stages_stop = 0;
+	aggregate_done = 0;
+	aggregate_thread = g_thread_new("aggregate", aggregate_stage, NULL);
+	write_thread = g_thread_new("write", write_stage, NULL);
+}
+
+// lets the stages finish what is in their queues, then ends them
+static void stop_stages(void)
+{
+	if (!aggregate_thread) return;
+
+	__atomic_store_n(&stages_stop, 1, __ATOMIC_RELEASE);
+	queue_kick(&spec_queue);
+	g_thread_join(aggregate_thread);
+	aggregate_thread = NULL;
+
+	__atomic_store_n(&aggregate_done, 1, __ATOMIC_RELEASE);
+	queue_kick(&row_queue);
+	g_thread_join(write_thread);
+	write_thread = NULL;
+
+	if (stats_interval > 0) report_queues();
 }
 
+
 static void close_wav(void)
 {
 	if (wavfile != 0)
@@ -322,9 +2482,12 @@ static void close_wav(void)
 	}
 }
 
-static void write_wav(double data[3], gboolean check)
+// writes the events data[0..count-1], without their moving average
+static void write_wav(CPhidgetSpatial_SpatialEventDataHandle* data, int count)
 {
-	if (check)
+	fftw_real first[3];
+	for (int i = 0;i < 3;i++) first[i] = data[0]->acceleration[i] / MAX_G;
+
 	{
 		time_t rawtime;
 		time(&rawtime);
@@ -342,12 +2505,12 @@ static void write_wav(double data[3], gboolean check)
 
 			// file does not exist. create it and open it		
 			sfinfo.channels = 3;
-			sfinfo.format = SF_FORMAT_WAV | SF_FORMAT_DOUBLE;
+			sfinfo.format = SF_FORMAT_WAV | WAV_FORMAT;
 			sfinfo.samplerate = samplerate;
 			wavfile = sf_open(filename, SFM_WRITE, &sfinfo);
 
 			// initialise moving average
-			for (int i = 0;i < 3;i++) moving_average[i] = data[i];
+			for (int i = 0;i < 3;i++) moving_average[i] = first[i];
 		}
 
 		if (wavfile == 0)
@@ -357,65 +2520,357 @@ static void write_wav(double data[3], gboolean check)
 			sf_seek(wavfile, 0, SEEK_END);
 
 			// initialise moving average
-			for (int i = 0;i < 3;i++) moving_average[i] = data[i];
+			for (int i = 0;i < 3;i++) moving_average[i] = first[i];
+		}
+	}
+
+	for (int k = 0;k < count;k += WAV_CHUNK)
+	{
+		fftw_real buf[3 * WAV_CHUNK];
+		int n = MIN(WAV_CHUNK, count - k);
+
+		// calculate moving average
+		for (int s = 0;s < n;s++)
+		{
+			for (int i = 0;i < 3;i++)
+			{
+				double v = data[k + s]->acceleration[i] / MAX_G;
+				moving_average[i] = avgconst * moving_average[i] + (1.0 - avgconst) * v;
+				buf[3 * s + i] = v - moving_average[i];
+			}
+		}
+
+		if (wavfile != 0)
+		{
+			sf_write_real(wavfile, buf, 3 * n);
 		}
 	}
+}
 
-	// calculate moving average
+// feeds one sample into the sliding DFTs and queues a row for
+// output_tracks() every track_interval_ms
+static void track_sample(double acceleration[3], gint64 t)
+{
 	for (int i = 0;i < 3;i++)
 	{
-		moving_average[i] = avgconst * moving_average[i] + (1.0 - avgconst) * data[i];
-		data[i] -= moving_average[i];
+		sdft_update(tracker[i], acceleration[i]);
 	}
 
-	if (wavfile != 0)
+	if (--track_countdown > 0) return;
+	track_countdown = MAX(1, track_interval_ms * samplerate / 1000);
+
+	int tail = __atomic_load_n(&track_tail, __ATOMIC_ACQUIRE);
+	if (track_head - tail == TRACK_QUEUE_LEN)
+	{
+		track_lost++;
+		track_pending_lost++;
+		return;
+	}
+
+	int r = track_head % TRACK_QUEUE_LEN;
+	fftw_real* v = track_values + r * 3 * ntracks;
+	track_time[r] = t;
+	track_gap[r] = track_pending_lost;
+	track_pending_lost = 0;
+	for (int t = 0;t < ntracks;t++)
+	{
+		for (int i = 0;i < 3;i++)
+		{
+			v[3 * t + i] = sdft_magnitude(tracker[i], t);
+		}
+	}
+	__atomic_store_n(&track_head, track_head + 1, __ATOMIC_RELEASE);
+
+	// a batch is ready: wake the write stage, it may sleep up to
+	// WAKEUP_TIMEOUT_MS otherwise (one eventfd write per batch)
+	if ((track_head - tail >= TRACK_FLUSH_ROWS) && (track_head % TRACK_FLUSH_ROWS == 0))
 	{
-		sf_write_double(wavfile, data, 3);
+		queue_kick(&row_queue);
 	}
 }
 
-// callback that will run when data arrive
-int CCONV SpatialDataHandler(CPhidgetSpatialHandle spatial, void *userptr, 
-	CPhidgetSpatial_SpatialEventDataHandle *data, int count)
+static inline gint32 to_int32(double v)
 {
-	for (int k = 0;k < count;k++)
+	return (gint32)lrint(CLAMP(v * counts_per_g, -2147483647.0, 2147483647.0));
+}
+
+static inline gint16 to_int16(double v)
+{
+	return (gint16)lrint(CLAMP(v * counts_per_g, -32767.0, 32767.0));
+}
+
+// Stores the events data[0..n-1] as the next samples of the current
+// segment. Destination, layout and format are settled once for the run, so
+// the loops only deinterleave: one pass over the events, three stores each.
+static void store_run(CPhidgetSpatial_SpatialEventDataHandle* data, int n)
+{
+	void* base;
+	int idx, step, axis_stride;
+
+	if (ring.dest == DEST_RING)
+	{
+		base = ring.data;
+		idx = ring_index(0, (ring.head % ring.nsegs) * hop + ring.fill);
+		step = ring.step;
+		axis_stride = ring.axis_stride;
+	}
+	else if (ring.dest == DEST_SPILL)
+	{
+		base = spill.buf; // 3 planes of hop samples
+		idx = ring.fill;
+		step = 1;
+		axis_stride = hop;
+	}
+	else
+	{
+		return;
+	}
+
+	if (sample_format == SAMPLE_REAL)
+	{
+		fftw_real* d = (fftw_real*)base + idx;
+		for (int s = 0;s < n;s++, d += step)
+		{
+			const double* a = data[s]->acceleration;
+			d[0] = a[0];
+			d[axis_stride] = a[1];
+			d[2 * axis_stride] = a[2];
+		}
+	}
+	else if (sample_format == SAMPLE_INT32)
+	{
+		gint32* d = (gint32*)base + idx;
+		for (int s = 0;s < n;s++, d += step)
+		{
+			const double* a = data[s]->acceleration;
+			d[0] = to_int32(a[0]);
+			d[axis_stride] = to_int32(a[1]);
+			d[2 * axis_stride] = to_int32(a[2]);
+		}
+	}
+	else
 	{
-		if (wav)
+		gint16* d = (gint16*)base + idx;
+		for (int s = 0;s < n;s++, d += step)
 		{
-			double buf[3] = {
-				data[k]->acceleration[0] / MAX_G, // x
-				data[k]->acceleration[1] / MAX_G, // y
-				data[k]->acceleration[2] / MAX_G  // z 	
-			};		
-			write_wav(buf, k == 0);
+			const double* a = data[s]->acceleration;
+			d[0] = to_int16(a[0]);
+			d[axis_stride] = to_int16(a[1]);
+			d[2 * axis_stride] = to_int16(a[2]);
 		}
+	}
+}
 
-		for (int i = 0;i < 3;i++)
+// blocks until the producer has finished a segment, the aggregate stage
+// has freed a slot of spec_queue, a signal arrives or WAKEUP_TIMEOUT_MS have
+// passed
+static void wait_for_data(void)
+{
+	if (wakeup_fd < 0)
+	{
+		usleep(2000);
+		return;
+	}
+
+	struct pollfd pfd[2] = {{wakeup_fd, POLLIN, 0}, {spec_queue.room_fd, POLLIN, 0}};
+	if (poll(pfd, (spec_queue.room_fd >= 0) ? 2 : 1, WAKEUP_TIMEOUT_MS) > 0)
+	{
+		// resets the counters, the ring and the queue tell what is to do
+		guint64 count;
+		for (int i = 0;i < 2;i++)
 		{
-			double v = data[k]->acceleration[i];
-			inbuf[ibptr][i][rbufi] = v;
+			if ((pfd[i].revents & POLLIN) && (read(pfd[i].fd, &count, sizeof(count)) < 0)) return;
 		}
-		rbufi++;
+	}
+}
+
+// Decides at the start of a segment where its samples go. Its slot is the
+// oldest one of the ring, which the consumer must be done with, including
+// the history of its next block. If it is not, overflow_policy applies.
+static void begin_segment(gint64 t)
+{
+	// the spill thread pops a segment after it has counted it in head
+	if (spill.active && !queue_depth(&spill.out) &&
+		(__atomic_load_n(&spill.tail, __ATOMIC_ACQUIRE) == __atomic_load_n(&spill.head, __ATOMIC_ACQUIRE)))
+	{
+		// the consumer has read everything back, the ring is ours again
+		spill.active = FALSE;
+		spill.base = spill.head;
+		if (ftruncate(spill.fd, 0) < 0) printf("ERROR: could not truncate the spill file\n");
+	}
+
+	// once behind, stay in overflow until half of the ring is free again:
+	// few long gaps instead of many short ones
+	// (while the spill queue is active the consumer advances ring.head)
+	guint64 used = __atomic_load_n(&ring.head, __ATOMIC_ACQUIRE) -
+		__atomic_load_n(&ring.tail, __ATOMIC_ACQUIRE);
+	guint64 room = ring.nsegs - ring.history;
+	gboolean full = spill.active || (used >= room) || (ring.overflow && (used > room / 2));
+	if (full && !ring.overflow)
+	{
+		printf("Realtime error! Processing is behind, overflow policy: %s\n", overflow_name);
+	}
+	ring.overflow = full;
+
+	if (!full || (overflow_policy == OVERFLOW_DROP_OLDEST))
+	{
+		ring.dest = DEST_RING;
+	}
+	else if ((overflow_policy == OVERFLOW_SPILL) && (spill.fd >= 0) && (queue_room(&spill.out) > 0) &&
+		((__atomic_load_n(&spill.head, __ATOMIC_ACQUIRE) - spill.base + queue_depth(&spill.out) + 1) *
+			spill.rec_size <= ((guint64)spill_limit_mb << 20)))
+	{
+		ring.dest = DEST_SPILL;
+		spill.buf = queue_back(&spill.out, 0);
+		spill.active = TRUE;
+	}
+	else
+	{
+		ring.dest = DEST_DROP;
+	}
+
+	if ((ring.dest == DEST_RING) && (overflow_policy == OVERFLOW_DROP_OLDEST))
+	{
+		// write side of the seqlock: mark the slot, then fill it
+		__atomic_store_n(&ring.tags[ring.head % ring.nsegs], TAG_BUSY, __ATOMIC_RELAXED);
+		__atomic_thread_fence(__ATOMIC_RELEASE);
+	}
+
+	if (ring.dest == DEST_RING)
+	{
+		__atomic_store_n(&ring.times[ring.head % ring.nsegs], t, __ATOMIC_RELAXED);
+	}
+	else if (ring.dest == DEST_SPILL)
+	{
+		memcpy((char*)spill.buf + spill.rec_size - sizeof(gint64), &t, sizeof(gint64));
+	}
+}
+
+// publishes the completed segment or counts it as lost
+static void end_segment(void)
+{
+	ring.fill = 0;
 
-		if (rbufi == samplerate)
+	if (ring.dest == DEST_RING)
+	{
+		if (overflow_policy == OVERFLOW_DROP_OLDEST)
 		{
-			rbufi = 0;
-			unproc[ibptr] = TRUE;
-			ibptr++;
-			if (ibptr >= PIPELINE_LEN) ibptr = 0;
+			__atomic_store_n(&ring.tags[ring.head % ring.nsegs], ring.head, __ATOMIC_RELEASE);
+		}
+		__atomic_store_n(&ring.head, ring.head + 1, __ATOMIC_RELEASE);
+		queue_signal_fd(wakeup_fd);
+		return;
+	}
 
-			if (unproc[ibptr])
-			{
-				printf("Realtime error!\n");
-			}
+	if (ring.dest == DEST_SPILL)
+	{
+		// the spill thread writes it and wakes the consumer
+		queue_push(&spill.out, 1);
+		return;
+	}
+
+	__atomic_store_n(&ring.lost, ring.lost + hop, __ATOMIC_RELAXED);
+	__atomic_store_n(&ring.lost_segs, ring.lost_segs + 1, __ATOMIC_RELAXED);
+}
+
+// Wall clock time of an event in us. The device clock counts from the
+// opening of the device and does not drift against the samples; it is
+// anchored to the wall clock at the first event, and again when it jumps
+// back (the device was reattached). Its crystal drifts by some ppm against
+// the wall clock though, so every CLOCK_RESYNC_US time_base is slewed
+// towards the wall clock by at most CLOCK_SLEW_MAX_US. The callback comes
+// late by a varying latency, the least offset of the interval is the best
+// estimate. An offset beyond CLOCK_STEP_US (the wall clock was set) is
+// taken over at once.
+static gint64 event_time(CPhidgetSpatial_SpatialEventDataHandle ev)
+{
+	gint64 t = (gint64)ev->timestamp.seconds * G_USEC_PER_SEC + ev->timestamp.microseconds;
+	gint64 offset = g_get_real_time() - t;
+
+	if (t < last_device_time || last_device_time < 0)
+	{
+		time_base = offset;
+		least_offset = offset;
+		next_resync = t + CLOCK_RESYNC_US;
+	}
+	last_device_time = t;
+	least_offset = MIN(least_offset, offset);
+
+	if (t >= next_resync)
+	{
+		gint64 err = least_offset - time_base;
+		if ((err > CLOCK_STEP_US) || (err < -CLOCK_STEP_US))
+		{
+			time_base = least_offset;
+		}
+		else
+		{
+			time_base += CLAMP(err, -CLOCK_SLEW_MAX_US, CLOCK_SLEW_MAX_US);
+		}
+		least_offset = offset;
+		next_resync = t + CLOCK_RESYNC_US;
+	}
+
+	return time_base + t;
+}
+
+// callback that will run when data arrive
+int CCONV SpatialDataHandler(CPhidgetSpatialHandle spatial, void *userptr, 
+	CPhidgetSpatial_SpatialEventDataHandle *data, int count)
+{
+	if (realtime && !rt_thread_ready)
+	{
+		rt_setup_thread("callback", rt_policy, rt_priority, callback_cpus);
+		rt_thread_ready = TRUE;
+	}
+
+	if (wav && (count > 0)) write_wav(data, count);
+
+	// the events in runs that end with the events or with the segment
+	for (int k = 0;k < count;)
+	{
+		if (ring.fill == 0) begin_segment(event_time(data[k]));
+
+		int n = MIN(count - k, hop - ring.fill);
+		store_run(data + k, n);
+
+		if (ntracks)
+		{
+			for (int s = k;s < k + n;s++) track_sample(data[s]->acceleration, event_time(data[s]));
 		}
+
+		k += n;
+		ring.fill += n;
+		if (ring.fill == hop) end_segment();
 	}
 	return 0;
 }
 
+static void report_lost(void)
+{
+	guint64 lost = ring.lost + consumer_lost + spill.lost_segs * hop;
+	if (lost)
+	{
+		printf("lost %llu samples in %llu segments of %i\n", (unsigned long long)lost,
+			(unsigned long long)(ring.lost_segs + consumer_lost_segs + spill.lost_segs), hop);
+	}
+	if (track_lost)
+	{
+		printf("lost %i rows of tracked bins\n", track_lost);
+	}
+}
+
 static void close_output(void)
 {
+	if (pool)
+	{
+		g_thread_pool_free(pool, FALSE, TRUE);
+		pool = NULL;
+	}
+	stop_stages();
 	close_wav();
+	if (overflow_policy == OVERFLOW_SPILL) close_spill();
+	report_lost();
 }
 
 // callback that will run if the sensor is attached to the computer
@@ -470,6 +2925,12 @@ static int display_properties(CPhidgetHandle phid)
 	return 0;
 }
 
+// stop the main loop on SIGINT and SIGTERM, so that we can clean up
+static void quit_handler(int sig)
+{
+	quit = 1;
+}
+
 static gboolean controlloop(void)
 {
 	int result;
@@ -515,25 +2976,51 @@ static gboolean controlloop(void)
 	{
 		open_output();
 
+		// without an eventfd we fall back to polling every 2 ms
+		wakeup_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+		if (wakeup_fd < 0)
+		{
+			printf("no eventfd, falling back to polling\n");
+		}
+
 		// register data callback
 		CPhidgetSpatial_set_OnSpatialData_Handler(spatial, SpatialDataHandler, NULL);
 
 		// set data rate for the spatial events
 		CPhidgetSpatial_setDataRate(spatial, (int)(1000 / samplerate));
 
-		for (;;)
+		signal(SIGINT, quit_handler);
+		signal(SIGTERM, quit_handler);
+
+		start_stages();
+
+		gint64 next_stats = g_get_monotonic_time() + (gint64)stats_interval * G_USEC_PER_SEC;
+		while (!quit)
 		{
 			process();
-			usleep(2000);
+			wait_for_data();
+
+			if ((stats_interval > 0) && (g_get_monotonic_time() >= next_stats))
+			{
+				report_queues();
+				next_stats += (gint64)stats_interval * G_USEC_PER_SEC;
+			}
 		}
 	}
 
-	close_output();
-
 	printf("Closing...\n");
 	CPhidget_close((CPhidgetHandle)spatial);
 	CPhidget_delete((CPhidgetHandle)spatial);
 
+	close_output();
+	save_wisdom();
+
+	if (wakeup_fd >= 0)
+	{
+		close(wakeup_fd);
+		wakeup_fd = -1;
+	}
+
 	return TRUE;
 }
 
@@ -551,6 +3038,10 @@ int main(int argc, char *argv[])
 		res = FALSE;
 		printf("ERROR: invalid options\n");
 	}
+	else if (!check_options())
+	{
+		res = FALSE;
+	}
 	else if (!controlloop())
 	{
 		res = FALSE;
@@ -26,8 +26,9 @@ import matplotlib.pyplot as plt
 import matplotlib.cm as cm
 
 
-def append_Hz(v):
-	return "%i Hz" % v
+# "12.5 Hz" -> 12.5
+def freq_of(key):
+	return float(key[:-3])
 
 
 def get_hour(str):
@@ -94,13 +95,11 @@ def read_csvfile(name, mintime, maxtime, minfreq, maxfreq, dboffset, scale):
 		else:
 			# extract head line
 			if frequencies is None:
-				frequencies = row.keys()
-				frequencies.remove('timestamp')
-				frequencies = map(int, map(lambda c: c[:-3], frequencies))
-				frequencies.sort()
-				frequencies = filter(lambda a: a >= int(minfreq), frequencies)
-				frequencies = filter(lambda a: a <= int(maxfreq), frequencies)
-				freqs = map(append_Hz, frequencies)
+				freqs = filter(lambda k: k.endswith(' Hz'), row.keys())
+				freqs.sort(key=freq_of)
+				freqs = filter(lambda k: freq_of(k) >= float(minfreq), freqs)
+				freqs = filter(lambda k: freq_of(k) <= float(maxfreq), freqs)
+				frequencies = map(freq_of, freqs)
 
 			timestamp = row['timestamp']
 			tswy = timestamp[11:16]
@@ -156,10 +155,15 @@ def plot_csvfile(filename, tdpi, mintime, maxtime, odir, minfreq,
 		ax = plt.gca()
 		ax.set_xticks(timestamps_index)
 		ax.set_xticklabels(timestamps_labels)
-		filter_freqs = filter(lambda a: a % int(freqdist) == 0, frequencies)
+		# one tick at the first bin at or above every multiple of freqdist
+		filter_freqs = []
 		filter_inds = []
-		for filter_freq in filter_freqs:
-			filter_inds.append(frequencies.index(filter_freq))
+		next_tick = 0.0
+		for ind, freq in enumerate(frequencies):
+			if freq >= next_tick:
+				filter_freqs.append('%g' % freq)
+				filter_inds.append(ind)
+				next_tick = (int(freq / float(freqdist)) + 1) * float(freqdist)
 		ax.set_yticks(filter_inds)
 		ax.set_yticklabels(filter_freqs)
 		cbar = plt.colorbar(img, pad=0.01)
@@ -183,7 +187,8 @@ def get_csv_files_in_directory(dir):
 	for path, subdirs, files in os.walk(dir):
 		for name in files:
 			(root, ext) = os.path.splitext(name)
-			if ext.lower() == '.csv':
+			# the tracked frequencies are no spectrum
+			if ext.lower() == '.csv' and not root.endswith('_track_accel'):
 				res.append(os.path.join(path, name))
 	res.sort()
 	return res
@@ -0,0 +1,127 @@
+/*
+    Bounded single producer / single consumer queue of fixed-size slots,
+    which connects the stages of the processing pipeline.
+
+    Copyright (C) 2015  Steffen Kühn / steffen.kuehn@em-sys-dev.de
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include <glib.h>
+#include <unistd.h>
+#include <poll.h>
+#include <sys/eventfd.h>
+#include "queue.h"
+
+gboolean queue_init(stage_queue* q, void* mem, int len, size_t slot_size)
+{
+	q->slots = mem;
+	q->len = len;
+	q->slot_size = slot_size;
+	q->head = 0;
+	q->tail = 0;
+	q->high = 0;
+	q->data_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+	q->room_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+	return (q->data_fd >= 0) && (q->room_fd >= 0);
+}
+
+void queue_free(stage_queue* q)
+{
+	if (!q->slots) return;
+
+	if (q->data_fd >= 0) close(q->data_fd);
+	if (q->room_fd >= 0) close(q->room_fd);
+	q->data_fd = -1;
+	q->room_fd = -1;
+	q->slots = NULL;
+}
+
+void queue_signal_fd(int fd)
+{
+	guint64 one = 1;
+
+	// adds to the eventfd counter, which cannot overflow in practice
+	if (fd >= 0)
+	{
+		if (write(fd, &one, sizeof(one)) < 0) return;
+	}
+}
+
+// blocks until fd is signalled or timeout_ms passed, then resets it
+static void wait_fd(int fd, int timeout_ms)
+{
+	if (fd < 0)
+	{
+		usleep(2000);
+		return;
+	}
+
+	struct pollfd pfd = {fd, POLLIN, 0};
+	if (poll(&pfd, 1, timeout_ms) > 0)
+	{
+		guint64 count;
+		if (read(fd, &count, sizeof(count)) < 0) return;
+	}
+}
+
+int queue_room(const stage_queue* q)
+{
+	return q->len - (int)(q->head - __atomic_load_n(&q->tail, __ATOMIC_ACQUIRE));
+}
+
+void* queue_back(stage_queue* q, int k)
+{
+	return q->slots + ((q->head + k) % q->len) * q->slot_size;
+}
+
+void queue_push(stage_queue* q, int n)
+{
+	__atomic_store_n(&q->head, q->head + n, __ATOMIC_RELEASE);
+	q->high = MAX(q->high, queue_depth(q));
+	queue_signal_fd(q->data_fd);
+}
+
+void* queue_front(stage_queue* q)
+{
+	if (__atomic_load_n(&q->head, __ATOMIC_ACQUIRE) == q->tail) return NULL;
+	return q->slots + (q->tail % q->len) * q->slot_size;
+}
+
+void queue_pop(stage_queue* q)
+{
+	__atomic_store_n(&q->tail, q->tail + 1, __ATOMIC_RELEASE);
+	queue_signal_fd(q->room_fd);
+}
+
+int queue_depth(const stage_queue* q)
+{
+	guint64 tail = __atomic_load_n(&q->tail, __ATOMIC_ACQUIRE);
+	return (int)(__atomic_load_n(&q->head, __ATOMIC_ACQUIRE) - tail);
+}
+
+void queue_wait_data(stage_queue* q, int timeout_ms)
+{
+	wait_fd(q->data_fd, timeout_ms);
+}
+
+void queue_wait_room(stage_queue* q, int timeout_ms)
+{
+	wait_fd(q->room_fd, timeout_ms);
+}
+
+void queue_kick(stage_queue* q)
+{
+	queue_signal_fd(q->data_fd);
+}
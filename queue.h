@@ -0,0 +1,69 @@
+/*
+    Bounded single producer / single consumer queue of fixed-size slots,
+    which connects the stages of the processing pipeline.
+
+    Copyright (C) 2015  Steffen Kühn / steffen.kuehn@em-sys-dev.de
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef QUEUE_H
+#define QUEUE_H
+
+#include <glib.h>
+
+// head counts the pushed slots and is only written by the producer, tail
+// counts the popped ones and is only written by the consumer. Each side
+// publishes its counter with a release store and reads the other one with
+// an acquire load. Two eventfds let the sides sleep: data_fd is signalled
+// on every push, room_fd on every pop.
+typedef struct
+{
+	char* slots; // len slots of slot_size bytes, memory of the caller
+	int len;
+	size_t slot_size;
+	guint64 head;
+	guint64 tail;
+	int data_fd;
+	int room_fd;
+	int high; // largest depth seen so far (producer only)
+} stage_queue;
+
+// slot_size should be a multiple of the cache line, mem holds len slots
+gboolean queue_init(stage_queue* q, void* mem, int len, size_t slot_size);
+void queue_free(stage_queue* q);
+
+// producer: free slots, the k-th of them, publish the first n of them
+int queue_room(const stage_queue* q);
+void* queue_back(stage_queue* q, int k);
+void queue_push(stage_queue* q, int n);
+
+// consumer: the oldest slot or NULL if there is none, hand it back
+void* queue_front(stage_queue* q);
+void queue_pop(stage_queue* q);
+
+// slots pushed and not yet popped, from either side
+int queue_depth(const stage_queue* q);
+
+// sleep until the other side has pushed (popped) or timeout_ms passed
+void queue_wait_data(stage_queue* q, int timeout_ms);
+void queue_wait_room(stage_queue* q, int timeout_ms);
+
+// wakes a consumer in queue_wait_data(), e.g. to let it see a stop flag
+void queue_kick(stage_queue* q);
+
+// signals an eventfd (-1: none), for sleepers outside of a queue too
+void queue_signal_fd(int fd);
+
+#endif
@@ -0,0 +1,185 @@
+/*
+    Realtime helpers: scheduling class, CPU affinity and locked, prefaulted
+    memory for the threads of the acquisition path.
+
+    Copyright (C) 2015  Steffen Kühn / steffen.kuehn@em-sys-dev.de
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#define _GNU_SOURCE // cpu_set_t
+#include <glib.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <sched.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/resource.h>
+#include "realtime.h"
+
+#define PREFAULT_STACK_SIZE (256 * 1024) // stack a thread may use without a fault
+
+// "0-3,6" -> {0, 1, 2, 3, 6}
+static gboolean parse_cpus(const char* list, cpu_set_t* set)
+{
+	const char* p = list;
+
+	CPU_ZERO(set);
+	while (*p)
+	{
+		char* end;
+		long first = strtol(p, &end, 10);
+		long last = first;
+
+		if (end == p) return FALSE;
+		if (*end == '-')
+		{
+			p = end + 1;
+			last = strtol(p, &end, 10);
+			if (end == p) return FALSE;
+		}
+		if ((first < 0) || (last < first) || (last >= CPU_SETSIZE)) return FALSE;
+
+		for (long cpu = first;cpu <= last;cpu++) CPU_SET(cpu, set);
+
+		p = end;
+		if (*p == ',')
+		{
+			p++;
+		}
+		else if (*p)
+		{
+			return FALSE;
+		}
+	}
+	return CPU_COUNT(set) > 0;
+}
+
+gboolean rt_check_cpus(const char* cpus)
+{
+	cpu_set_t set;
+	return parse_cpus(cpus, &set);
+}
+
+// the stack grows on demand, which is a page fault each time
+static void prefault_stack(void)
+{
+	char buf[PREFAULT_STACK_SIZE];
+
+	rt_prefault(buf, sizeof(buf));
+}
+
+gboolean rt_setup_thread(const char* name, int policy, int priority, const char* cpus)
+{
+	gboolean ok = TRUE;
+
+	// with pid 0 both calls affect the calling thread only
+	if (cpus)
+	{
+		cpu_set_t set;
+		if (!parse_cpus(cpus, &set) || sched_setaffinity(0, sizeof(set), &set))
+		{
+			printf("ERROR: could not pin the %s thread to CPUs %s: %s\n",
+				name, cpus, strerror(errno));
+			ok = FALSE;
+		}
+	}
+
+	struct sched_param param = {0};
+	param.sched_priority = priority;
+	if (sched_setscheduler(0, policy, &param))
+	{
+		if (errno == EPERM)
+		{
+			printf("ERROR: no permission for realtime scheduling of the %s thread; "
+				"run as root, give the binary CAP_SYS_NICE or allow rtprio %i "
+				"in /etc/security/limits.conf\n", name, priority);
+		}
+		else
+		{
+			printf("ERROR: could not set realtime scheduling of the %s thread: %s\n",
+				name, strerror(errno));
+		}
+		ok = FALSE;
+	}
+
+	prefault_stack();
+	return ok;
+}
+
+gboolean rt_reset_thread(const char* name)
+{
+	gboolean ok = TRUE;
+
+	// all configured CPUs, the kernel limits them to the cpuset if any
+	cpu_set_t set;
+	CPU_ZERO(&set);
+	long ncpus = sysconf(_SC_NPROCESSORS_CONF);
+	for (long cpu = 0;(cpu < ncpus) && (cpu < CPU_SETSIZE);cpu++) CPU_SET(cpu, &set);
+	if (sched_setaffinity(0, sizeof(set), &set))
+	{
+		printf("ERROR: could not unpin the %s thread: %s\n", name, strerror(errno));
+		ok = FALSE;
+	}
+
+	struct sched_param param = {0};
+	if (sched_setscheduler(0, SCHED_OTHER, &param))
+	{
+		printf("ERROR: could not reset the scheduling of the %s thread: %s\n", name, strerror(errno));
+		ok = FALSE;
+	}
+	return ok;
+}
+
+gboolean rt_lock_memory(void)
+{
+	// With a memlock limit, MCL_FUTURE makes every later mapping fail that
+	// does not fit in, thread stacks included. Lock only what is there then.
+	struct rlimit lim;
+	int flags = MCL_CURRENT | MCL_FUTURE;
+	if ((geteuid() != 0) && !getrlimit(RLIMIT_MEMLOCK, &lim) && (lim.rlim_cur != RLIM_INFINITY))
+	{
+		printf("memlock limit of %lu kB, memory allocated later is not locked\n",
+			(unsigned long)(lim.rlim_cur / 1024));
+		flags = MCL_CURRENT;
+	}
+
+	if (mlockall(flags) == 0) return TRUE;
+
+	if ((errno == EPERM) || (errno == ENOMEM))
+	{
+		printf("ERROR: could not lock the memory (%s); run as root, give the "
+			"binary CAP_IPC_LOCK or raise memlock in /etc/security/limits.conf "
+			"(ulimit -l)\n", strerror(errno));
+	}
+	else
+	{
+		printf("ERROR: could not lock the memory: %s\n", strerror(errno));
+	}
+	return FALSE;
+}
+
+void rt_prefault(void* p, size_t len)
+{
+	volatile char* c = p;
+	long page = sysconf(_SC_PAGESIZE);
+
+	if (!p) return;
+
+	// write what is there: the contents stay, but the page is really mapped
+	for (size_t i = 0;i < len;i += page) c[i] = c[i];
+	if (len) c[len - 1] = c[len - 1];
+}
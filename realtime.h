@@ -0,0 +1,44 @@
+/*
+    Realtime helpers: scheduling class, CPU affinity and locked, prefaulted
+    memory for the threads of the acquisition path.
+
+    Copyright (C) 2015  Steffen Kühn / steffen.kuehn@em-sys-dev.de
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef REALTIME_H
+#define REALTIME_H
+
+#include <glib.h>
+#include <sched.h> // SCHED_FIFO, SCHED_RR
+
+// TRUE if cpus is a list like "2" or "0-3,6"
+gboolean rt_check_cpus(const char* cpus);
+
+// puts the calling thread under policy with priority and, unless cpus is
+// NULL, on the listed CPUs; prints what failed and why
+gboolean rt_setup_thread(const char* name, int policy, int priority, const char* cpus);
+
+// puts the calling thread back under SCHED_OTHER on all CPUs, for threads
+// that inherited the realtime settings of the thread that created them
+gboolean rt_reset_thread(const char* name);
+
+// locks all present and future pages of the process into RAM
+gboolean rt_lock_memory(void);
+
+// touches every page of [p, p + len), so that no page fault is left
+void rt_prefault(void* p, size_t len);
+
+#endif
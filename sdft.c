@@ -0,0 +1,109 @@
+/*
+    Sliding DFT: tracks single DFT bins and is updated after every sample.
+    It is the modulated form, which has no recursive twiddle factor and
+    therefore stays stable forever.
+
+    Copyright (C) 2015  Steffen Kühn / steffen.kuehn@em-sys-dev.de
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include <glib.h>
+#include <math.h>
+#include "sdft.h"
+
+// The window ending at sample n has the DFT
+//   X_k(n) = S_k(n) * exp(j 2 pi k (n + 1) / N)
+// with the accumulator
+//   S_k(n) = S_k(n-1) + (x(n) - x(n-N)) * exp(-j 2 pi k n / N).
+// The twiddle factor comes from a table, indexed with k * n mod N, so no
+// rounding error builds up in it. |X_k| = |S_k|, the rotation is not needed
+// for the magnitude.
+struct sdft
+{
+	int N;
+	int nbins;
+	int m; // n mod N, position in hist
+	double* hist; // the last N samples
+	double* tw_re; // cos(2 pi m / N)
+	double* tw_im; // -sin(2 pi m / N)
+	int* bins;
+	int* idx; // k * n mod N per bin
+	double* re;
+	double* im;
+};
+
+sdft* sdft_new(int N, const int* bins, int nbins)
+{
+	sdft* s = g_new0(sdft, 1);
+
+	s->N = N;
+	s->nbins = nbins;
+	s->hist = g_new0(double, N);
+	s->tw_re = g_new(double, N);
+	s->tw_im = g_new(double, N);
+	for (int m = 0;m < N;m++)
+	{
+		s->tw_re[m] = cos(2.0 * M_PI * m / N);
+		s->tw_im[m] = -sin(2.0 * M_PI * m / N);
+	}
+	s->bins = g_new(int, nbins);
+	s->idx = g_new0(int, nbins);
+	s->re = g_new0(double, nbins);
+	s->im = g_new0(double, nbins);
+	for (int b = 0;b < nbins;b++)
+	{
+		s->bins[b] = bins[b] % N;
+	}
+
+	return s;
+}
+
+void sdft_free(sdft* s)
+{
+	if (!s) return;
+
+	g_free(s->hist);
+	g_free(s->tw_re);
+	g_free(s->tw_im);
+	g_free(s->bins);
+	g_free(s->idx);
+	g_free(s->re);
+	g_free(s->im);
+	g_free(s);
+}
+
+void sdft_update(sdft* s, double x)
+{
+	double d = x - s->hist[s->m];
+	s->hist[s->m] = x;
+
+	for (int b = 0;b < s->nbins;b++)
+	{
+		int i = s->idx[b];
+		s->re[b] += d * s->tw_re[i];
+		s->im[b] += d * s->tw_im[i];
+
+		i += s->bins[b];
+		if (i >= s->N) i -= s->N;
+		s->idx[b] = i;
+	}
+
+	if (++s->m == s->N) s->m = 0;
+}
+
+double sdft_magnitude(const sdft* s, int b)
+{
+	return sqrt(s->re[b] * s->re[b] + s->im[b] * s->im[b]);
+}
@@ -0,0 +1,37 @@
+/*
+    Sliding DFT: tracks single DFT bins and is updated after every sample.
+    It is the modulated form, which has no recursive twiddle factor and
+    therefore stays stable forever.
+
+    Copyright (C) 2015  Steffen Kühn / steffen.kuehn@em-sys-dev.de
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef SDFT_H
+#define SDFT_H
+
+typedef struct sdft sdft;
+
+// tracks the DFT bins bins[0..nbins-1] over the last N samples
+sdft* sdft_new(int N, const int* bins, int nbins);
+void sdft_free(sdft* s);
+
+// O(1) per tracked bin
+void sdft_update(sdft* s, double x);
+
+// |X_k| of the bin bins[b] over the last N samples
+double sdft_magnitude(const sdft* s, int b);
+
+#endif
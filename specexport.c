@@ -0,0 +1,99 @@
+/*
+    Exports one axis of a spectrum archive (--format spec) as csv, in the
+    layout of the csv files of spatialreader.
+    Usage: specexport FILE [x|y|z] [decimals]
+
+    Copyright (C) 2015  Steffen Kühn / steffen.kuehn@em-sys-dev.de
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include "format.h"
+#include "kernels.h"
+#include "specfile.h"
+
+int main(int argc, char** argv)
+{
+	const char* axes = "xyz";
+	const char* a = (argc > 2) ? strchr(axes, argv[2][0]) : axes;
+	int decimals = (argc > 3) ? atoi(argv[3]) : 6;
+
+	if ((argc < 2) || (argc > 4) || !a || !*a || ((argc > 2) && argv[2][1]) ||
+		(decimals < 0) || (decimals > FORMAT_MAX_DECIMALS))
+	{
+		printf("usage: specexport FILE [x|y|z] [decimals 0..%i]\n", FORMAT_MAX_DECIMALS);
+		return 1;
+	}
+	int axis = a - axes;
+
+	specfile* f = specfile_open(argv[1]);
+	if (!f)
+	{
+		fprintf(stderr, "ERROR: %s: %s\n", argv[1],
+			(errno == EINVAL) ? "not a spectrum archive of a known version" : strerror(errno));
+		return 1;
+	}
+
+	kernels_init();
+
+	const specfile_info* info = &f->info;
+	if (axis >= (int)info->axes)
+	{
+		fprintf(stderr, "ERROR: %s has %u axes\n", argv[1], info->axes);
+		specfile_close(f);
+		return 1;
+	}
+
+	printf("timestamp");
+	for (uint32_t k = 0;k < info->nbins;k++)
+	{
+		printf(",%g Hz", (double)(info->first_bin + k) * info->samplerate / info->fft_size);
+	}
+	printf(",lost\n");
+
+	float* v = malloc(sizeof(float) * info->nbins);
+	char* row = malloc(32 + (info->nbins + 1) * (FORMAT_FIXED_MAX + 1));
+
+	for (size_t i = 0;i < f->count;i++)
+	{
+		time_t t = specfile_time(f, i) / 1000000;
+		struct tm tm;
+		localtime_r(&t, &tm);
+
+		char* p = row;
+		p += sprintf(p, "%4.4i-%2.2i-%2.2i %2.2i:%2.2i:%2.2i",
+			tm.tm_year + 1900, tm.tm_mon + 1, tm.tm_mday, tm.tm_hour, tm.tm_min, tm.tm_sec);
+
+		specfile_values(f, i, axis, v);
+		for (uint32_t k = 0;k < info->nbins;k++)
+		{
+			*p++ = ',';
+			p += format_fixed(p, v[k], decimals);
+		}
+		*p++ = ',';
+		p += format_uint(p, specfile_lost(f, i));
+		*p++ = '\n';
+		fwrite(row, 1, p - row, stdout);
+	}
+
+	free(v);
+	free(row);
+	specfile_close(f);
+	return 0;
+}
@@ -0,0 +1,299 @@
+/*
+    Binary spectrum archive: a self-describing header followed by fixed-size
+    little-endian records, one per averaging interval. Readers map the file
+    and get any record in O(1).
+
+    Copyright (C) 2015  Steffen Kühn / steffen.kuehn@em-sys-dev.de
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "kernels.h"
+#include "specfile.h"
+
+#if defined(__BYTE_ORDER__) && (__BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__)
+#define HOST_LITTLE_ENDIAN 1
+#else
+#define HOST_LITTLE_ENDIAN 0
+#endif
+
+static void put_u32(unsigned char* p, uint32_t v)
+{
+	for (int i = 0;i < 4;i++) p[i] = v >> (8 * i);
+}
+
+static void put_u64(unsigned char* p, uint64_t v)
+{
+	for (int i = 0;i < 8;i++) p[i] = v >> (8 * i);
+}
+
+static uint32_t get_u32(const unsigned char* p)
+{
+	uint32_t v = 0;
+	for (int i = 0;i < 4;i++) v |= (uint32_t)p[i] << (8 * i);
+	return v;
+}
+
+static uint64_t get_u64(const unsigned char* p)
+{
+	uint64_t v = 0;
+	for (int i = 0;i < 8;i++) v |= (uint64_t)p[i] << (8 * i);
+	return v;
+}
+
+static void put_f32(unsigned char* p, float v)
+{
+	uint32_t u;
+	memcpy(&u, &v, sizeof(u));
+	put_u32(p, u);
+}
+
+static float get_f32(const unsigned char* p)
+{
+	uint32_t u = get_u32(p);
+	float v;
+	memcpy(&v, &u, sizeof(v));
+	return v;
+}
+
+// bytes of one value
+static size_t value_size(const specfile_info* info)
+{
+	return (info->encoding == SPECFILE_LOG16) ? sizeof(uint16_t) : sizeof(float);
+}
+
+void specfile_layout(specfile_info* info)
+{
+	info->version = SPECFILE_VERSION;
+	info->header_size = SPECFILE_HEADER_SIZE;
+	info->record_size = SPECFILE_RECORD_HEAD + value_size(info) * info->axes * info->nbins;
+}
+
+void specfile_put_header(const specfile_info* info, unsigned char* dst)
+{
+	memset(dst, 0, info->header_size);
+	memcpy(dst, SPECFILE_MAGIC, sizeof(SPECFILE_MAGIC));
+	put_u32(dst + 8, info->version);
+	put_u32(dst + 12, info->header_size);
+	put_u32(dst + 16, info->record_size);
+	put_u32(dst + 20, info->encoding);
+	put_u32(dst + 24, info->samplerate);
+	put_u32(dst + 28, info->fft_size);
+	put_u32(dst + 32, info->hop);
+	put_u32(dst + 36, info->first_bin);
+	put_u32(dst + 40, info->nbins);
+	put_u32(dst + 44, info->axes);
+	put_u32(dst + 48, info->interval_blocks);
+	put_u32(dst + 52, info->aggregation);
+	put_u32(dst + 56, info->kind);
+	// the strings stay 0 terminated
+	memcpy(dst + 60, info->units, strnlen(info->units, sizeof(info->units) - 1));
+	memcpy(dst + 76, info->window, strnlen(info->window, sizeof(info->window) - 1));
+	if (info->encoding == SPECFILE_LOG16)
+	{
+		put_f32(dst + 92, info->log_offset);
+		put_f32(dst + 96, info->log_scale);
+	}
+}
+
+int specfile_get_header(const unsigned char* src, size_t len, specfile_info* info)
+{
+	if ((len < SPECFILE_HEADER_SIZE) || memcmp(src, SPECFILE_MAGIC, sizeof(SPECFILE_MAGIC))) return -1;
+
+	info->version = get_u32(src + 8);
+	info->header_size = get_u32(src + 12);
+	info->record_size = get_u32(src + 16);
+	info->encoding = get_u32(src + 20);
+	info->samplerate = get_u32(src + 24);
+	info->fft_size = get_u32(src + 28);
+	info->hop = get_u32(src + 32);
+	info->first_bin = get_u32(src + 36);
+	info->nbins = get_u32(src + 40);
+	info->axes = get_u32(src + 44);
+	info->interval_blocks = get_u32(src + 48);
+	info->aggregation = get_u32(src + 52);
+	info->kind = get_u32(src + 56);
+	memcpy(info->units, src + 60, sizeof(info->units));
+	memcpy(info->window, src + 76, sizeof(info->window));
+	info->units[sizeof(info->units) - 1] = 0;
+	info->window[sizeof(info->window) - 1] = 0;
+	info->log_offset = get_f32(src + 92);
+	info->log_scale = get_f32(src + 96);
+
+	// only what this version can read
+	if ((info->version != SPECFILE_VERSION) ||
+		((info->encoding != SPECFILE_FLOAT32) && (info->encoding != SPECFILE_LOG16)) ||
+		(info->header_size < SPECFILE_HEADER_SIZE) || (info->header_size > len) ||
+		(info->record_size != SPECFILE_RECORD_HEAD + value_size(info) * info->axes * info->nbins))
+	{
+		return -1;
+	}
+	return 0;
+}
+
+void specfile_put_record_head(unsigned char* rec, int64_t time, uint64_t lost)
+{
+	put_u64(rec, (uint64_t)time);
+	put_u64(rec + 8, lost);
+}
+
+void specfile_put_values(const specfile_info* info, unsigned char* rec, int axis, const float* values)
+{
+	unsigned char* dst = rec + SPECFILE_RECORD_HEAD + value_size(info) * axis * info->nbins;
+
+	if (info->encoding == SPECFILE_LOG16)
+	{
+		if (HOST_LITTLE_ENDIAN)
+		{
+			// the codes are 2 byte aligned, records and the header are even
+			encode_log16(values, (uint16_t*)dst, info->nbins, info->log_offset, info->log_scale);
+			return;
+		}
+		for (uint32_t k = 0;k < info->nbins;k++)
+		{
+			uint16_t c;
+			encode_log16(values + k, &c, 1, info->log_offset, info->log_scale);
+			dst[2 * k] = c;
+			dst[2 * k + 1] = c >> 8;
+		}
+		return;
+	}
+
+	if (HOST_LITTLE_ENDIAN)
+	{
+		memcpy(dst, values, sizeof(float) * info->nbins);
+		return;
+	}
+	for (uint32_t k = 0;k < info->nbins;k++)
+	{
+		put_f32(dst + 4 * k, values[k]);
+	}
+}
+
+specfile* specfile_open(const char* name)
+{
+	int fd = open(name, O_RDONLY);
+	if (fd < 0) return NULL;
+
+	struct stat st;
+	if (fstat(fd, &st) < 0)
+	{
+		close(fd);
+		return NULL;
+	}
+
+	specfile* f = calloc(1, sizeof(specfile));
+	int err = 0;
+
+	f->size = st.st_size;
+	f->map = MAP_FAILED;
+	if (f->size < SPECFILE_HEADER_SIZE)
+	{
+		err = EINVAL;
+	}
+	else
+	{
+		f->map = mmap(NULL, f->size, PROT_READ, MAP_SHARED, fd, 0);
+		if (f->map == MAP_FAILED) err = errno;
+		else if (specfile_get_header(f->map, f->size, &f->info) < 0) err = EINVAL;
+	}
+	close(fd);
+
+	if (err)
+	{
+		if (f->map != MAP_FAILED) munmap((void*)f->map, f->size);
+		free(f);
+		errno = err;
+		return NULL;
+	}
+
+	// a record the writer has not finished is left out
+	f->count = (f->size - f->info.header_size) / f->info.record_size;
+	return f;
+}
+
+void specfile_close(specfile* f)
+{
+	if (!f) return;
+
+	munmap((void*)f->map, f->size);
+	free(f);
+}
+
+const unsigned char* specfile_record(const specfile* f, size_t i)
+{
+	return f->map + f->info.header_size + i * f->info.record_size;
+}
+
+int64_t specfile_time(const specfile* f, size_t i)
+{
+	return (int64_t)get_u64(specfile_record(f, i));
+}
+
+uint64_t specfile_lost(const specfile* f, size_t i)
+{
+	return get_u64(specfile_record(f, i) + 8);
+}
+
+void specfile_values(const specfile* f, size_t i, int axis, float* dst)
+{
+	const specfile_info* info = &f->info;
+	const unsigned char* src = specfile_record(f, i) + SPECFILE_RECORD_HEAD +
+		value_size(info) * axis * info->nbins;
+
+	if (info->encoding == SPECFILE_LOG16)
+	{
+		if (HOST_LITTLE_ENDIAN)
+		{
+			decode_log16((const uint16_t*)src, dst, info->nbins, info->log_offset, info->log_scale);
+			return;
+		}
+		for (uint32_t k = 0;k < info->nbins;k++)
+		{
+			uint16_t c = src[2 * k] | (src[2 * k + 1] << 8);
+			decode_log16(&c, dst + k, 1, info->log_offset, info->log_scale);
+		}
+		return;
+	}
+
+	if (HOST_LITTLE_ENDIAN)
+	{
+		memcpy(dst, src, sizeof(float) * info->nbins);
+		return;
+	}
+	for (uint32_t k = 0;k < info->nbins;k++)
+	{
+		dst[k] = get_f32(src + 4 * k);
+	}
+}
+
+size_t specfile_find(const specfile* f, int64_t t)
+{
+	// the records are in time order
+	size_t lo = 0, hi = f->count;
+	while (lo < hi)
+	{
+		size_t mid = lo + (hi - lo) / 2;
+		if (specfile_time(f, mid) < t) lo = mid + 1;
+		else hi = mid;
+	}
+	return lo;
+}
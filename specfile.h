@@ -0,0 +1,140 @@
+/*
+    Binary spectrum archive: a self-describing header followed by fixed-size
+    little-endian records, one per averaging interval. Readers map the file
+    and get any record in O(1).
+
+    Copyright (C) 2015  Steffen Kühn / steffen.kuehn@em-sys-dev.de
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef SPECFILE_H
+#define SPECFILE_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+// File layout, all numbers little-endian:
+//
+//   offset  size
+//   0       8    magic "ACCSPEC\0"
+//   8       4    version
+//   12      4    header_size, the first record starts here
+//   16      4    record_size
+//   20      4    encoding of the values, SPECFILE_FLOAT32 or SPECFILE_LOG16
+//   24      4    samplerate in Hz
+//   28      4    fft_size, bin k is at k * samplerate / fft_size Hz
+//   32      4    hop, samples from one block to the next
+//   36      4    first_bin
+//   40      4    nbins, bins first_bin .. first_bin + nbins - 1
+//   44      4    axes (3: x, y, z)
+//   48      4    blocks per interval
+//   52      4    aggregation, SPECFILE_AVERAGE or SPECFILE_MAXIMUM
+//   56      4    kind, SPECFILE_AMPLITUDE, SPECFILE_POWER or SPECFILE_DB
+//   60      16   units, 0 terminated, e.g. "mg"
+//   76      16   window, 0 terminated, e.g. "hann"
+//   92      4    log_offset, float, SPECFILE_LOG16 only
+//   96      4    log_scale, float, SPECFILE_LOG16 only
+//   100          zero up to header_size
+//
+// A record is
+//
+//   0       8    time of the end of the interval in us since 1970 (UTC)
+//   8       8    samples lost during the interval
+//   16           axes * nbins values, axis by axis, see encoding
+
+#define SPECFILE_MAGIC "ACCSPEC"
+#define SPECFILE_VERSION 1
+#define SPECFILE_HEADER_SIZE 256
+#define SPECFILE_RECORD_HEAD 16
+
+// encodings
+#define SPECFILE_FLOAT32 0 // IEEE 754 single
+#define SPECFILE_LOG16 1 // uint16 code c, the value is 2^(log_offset + c * log_scale), 0 for c = 0
+
+// aggregations
+#define SPECFILE_AVERAGE 0
+#define SPECFILE_MAXIMUM 1
+
+// kinds, the same as MAG_* of kernels.h
+#define SPECFILE_AMPLITUDE 0
+#define SPECFILE_POWER 1
+#define SPECFILE_DB 2
+
+typedef struct
+{
+	uint32_t version;
+	uint32_t header_size;
+	uint32_t record_size;
+	uint32_t encoding;
+	uint32_t samplerate;
+	uint32_t fft_size;
+	uint32_t hop;
+	uint32_t first_bin;
+	uint32_t nbins;
+	uint32_t axes;
+	uint32_t interval_blocks;
+	uint32_t aggregation;
+	uint32_t kind;
+	char units[16];
+	char window[16];
+	float log_offset;
+	float log_scale;
+} specfile_info;
+
+// writer
+
+// fills in version, header_size and record_size from the other fields
+void specfile_layout(specfile_info* info);
+
+// writes the header of info to dst[0..header_size-1]
+void specfile_put_header(const specfile_info* info, unsigned char* dst);
+
+// writes the time and lost count of the record rec
+void specfile_put_record_head(unsigned char* rec, int64_t time, uint64_t lost);
+
+// encodes the nbins values of axis into the record rec (for SPECFILE_LOG16
+// with the kernels of kernels.c, see kernels_init())
+void specfile_put_values(const specfile_info* info, unsigned char* rec, int axis, const float* values);
+
+// parses the header in src[0..len-1], returns 0 or -1 if it is none
+int specfile_get_header(const unsigned char* src, size_t len, specfile_info* info);
+
+// reader
+
+typedef struct
+{
+	specfile_info info;
+	const unsigned char* map;
+	size_t size;
+	size_t count; // complete records
+} specfile;
+
+// maps the file name, returns NULL with errno set on errors (EINVAL: no
+// spectrum archive)
+specfile* specfile_open(const char* name);
+void specfile_close(specfile* f);
+
+// record i, 0 <= i < count
+const unsigned char* specfile_record(const specfile* f, size_t i);
+int64_t specfile_time(const specfile* f, size_t i);
+uint64_t specfile_lost(const specfile* f, size_t i);
+
+// decodes the nbins values of axis of record i to dst
+void specfile_values(const specfile* f, size_t i, int axis, float* dst);
+
+// the first record with a time of t or later, count if there is none
+size_t specfile_find(const specfile* f, int64_t t);
+
+#endif